@@ -0,0 +1,42 @@
+#include "arena.h"
+
+#include <stdlib.h>
+
+#define CHUNK_HEAD arena_round (sizeof (arena_chunk_t))
+
+void *
+arena_alloc_slow (arena_t *arena, size_t size)
+{
+  arena_chunk_t *chunk;
+  size_t cap = ARENA_CHUNK_MIN;
+
+  if (arena->chunk && (cap = arena->chunk->cap << 1) > ARENA_CHUNK_MAX)
+    cap = ARENA_CHUNK_MAX;
+
+  if (cap < size + CHUNK_HEAD)
+    cap = size + CHUNK_HEAD;
+
+  if (!(chunk = malloc (cap)))
+    return NULL;
+
+  chunk->cap = cap;
+  chunk->next = arena->chunk;
+  arena->chunk = chunk;
+
+  char *data = (char *) chunk + CHUNK_HEAD;
+  arena->end = (char *) chunk + cap;
+  arena->pos = data + size;
+  return data;
+}
+
+void
+arena_free (arena_t *arena)
+{
+  for (arena_chunk_t *curr = arena->chunk, *next; curr; curr = next)
+    {
+      next = curr->next;
+      free (curr);
+    }
+
+  *arena = ARENA_INIT;
+}
@@ -0,0 +1,50 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 8
+#define ARENA_CHUNK_MIN 4096
+#define ARENA_CHUNK_MAX (1 << 20)
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct arena_t arena_t;
+typedef struct arena_chunk_t arena_chunk_t;
+
+struct arena_chunk_t
+{
+  arena_chunk_t *next;
+  size_t cap;
+};
+
+struct arena_t
+{
+  char *pos;
+  char *end;
+  arena_chunk_t *chunk;
+};
+
+#define ARENA_INIT                                                            \
+  (arena_t) {}
+
+#define arena_round(size) (((size) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+extern void *arena_alloc_slow (arena_t *arena, size_t size) attr_nonnull (1);
+
+extern void arena_free (arena_t *arena) attr_nonnull (1);
+
+static inline void *
+arena_alloc (arena_t *arena, size_t size)
+{
+  char *pos = arena->pos;
+  size = arena_round (size);
+
+  if (__builtin_expect ((size_t) (arena->end - pos) < size, 0))
+    return arena_alloc_slow (arena, size);
+
+  arena->pos = pos + size;
+  return pos;
+}
+
+#endif
@@ -1,38 +1,431 @@
 #include "json.h"
+#include "number.h"
+#include "structural.h"
 
-#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define ARRAY_INIT_CAP 8
 #define ARRAY_EXPAN_RATIO 2
-#define OBJECT_MAX_HEIGHT 48
+#define OBJECT_INIT_CAP 8
+#define OBJECT_EXPAN_RATIO 2
+#define OBJECT_SMALL_MAX 8
+#define INTERN_INIT_CAP 64
+#define LINES_CHUNK_LEN (256 << 10)
+#define SPLIT_RANGE_MIN (64 << 10)
+#define PLAN_SPLIT_MIN 64
+#define PLAN_DESCEND_MAX 2
+#define ENCODE_SCRATCH_LEN 256
+#define ENCODE_STREAM_LEN 8192
+#define WALK_INLINE_LEN 32
+#define QUERY_NONE UINT32_MAX
 
 #define unlikely(exp) __builtin_expect (!!(exp), 0)
+#define attr_unused __attribute__ ((unused))
+
+#define INDEX_GROUP 16
+#define INDEX_EMPTY 0x80
+#define INDEX_DELETED 0xFE
+#define INDEX_MIN_CAP 16
+
+#define HASH_SEED UINT64_C (0x9E3779B97F4A7C15)
+#define HASH_MUL UINT64_C (0xBF58476D1CE4E5B9)
+
+/* open addressing over groups of control bytes, each holding 7 bits of
+   the key hash, INDEX_EMPTY or INDEX_DELETED; a slot holds the position
+   of its pair plus base, so every position drops by one when base is
+   raised; front counts the pairs the vector start has advanced past its
+   allocation, until object_compact moves it back; deleted counts the
+   tombstones takes leave, which keep probe chains intact until the next
+   rebuild */
+struct json_index_t
+{
+  size_t mask;
+  size_t deleted;
+  uint32_t base;
+  uint32_t front;
+  uint32_t *slots;
+  uint8_t ctrl[];
+};
+
+typedef struct intern_t intern_t;
+typedef struct parser_t parser_t;
+typedef struct parse_frame_t parse_frame_t;
+typedef struct walk_t walk_t;
+typedef struct query_edge_t query_edge_t;
+typedef struct query_node_t query_node_t;
+typedef struct query_run_t query_run_t;
+typedef struct walk_frame_t walk_frame_t;
+typedef struct sax_t sax_t;
+typedef struct push_frame_t push_frame_t;
+typedef struct line_t line_t;
+typedef struct lines_t lines_t;
+typedef struct lines_chunk_t lines_chunk_t;
+typedef struct split_t split_t;
+typedef struct split_range_t split_range_t;
+typedef struct plan_t plan_t;
+typedef struct plan_part_t plan_part_t;
+
+static const bool is_ws[256] = {
+  [' '] = true,
+  ['\t'] = true,
+  ['\n'] = true,
+  ['\r'] = true,
+};
+
+/* the second byte of each escape, 'u' for the \u00XX form */
+static const char escape_table[128] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  ['"'] = '"',
+  ['\\'] = '\\',
+};
+
+typedef struct encoder_t encoder_t;
+
+typedef struct stream_t stream_t;
+typedef bool encoder_flush_t (encoder_t *e, size_t need);
+
+struct stream_t
+{
+  json_writer_t *write;
+  void *ctx;
+};
+
+/* output goes to the window [pos, end), flush makes more room in it */
+struct encoder_t
+{
+  char *pos;
+  char *end;
+  char *start;
+  int flags;
+  size_t size;
+  void *ctx;
+  encoder_flush_t *flush;
+};
+
+/* a container being visited and the number of its items done */
+struct walk_frame_t
+{
+  const json_t *json;
+  size_t next;
+};
+
+/* traversal stack of stringify, on the heap only for documents
+   nesting deeper than the inline frames */
+struct walk_t
+{
+  walk_frame_t *frames;
+  size_t size;
+  size_t cap;
+  walk_frame_t local[WALK_INLINE_LEN];
+};
+
+/* out-of-line keys already copied into the document arena, probed
+   linearly; empty slots are the zeroed (inline) strings */
+struct intern_t
+{
+  size_t cap;
+  size_t size;
+  mstr_t *slots;
+};
+
+struct parser_t
+{
+  const char *src;
+  const char *end;
+  const char *base;
+  const uint32_t *tape;
+  const uint32_t *tape_end;
+  arena_t *arena;
+  int flags;
+  size_t max_depth;
+  array_t frames;
+  array_t stack;
+  array_t pairs;
+  mstr_t scratch;
+  intern_t intern;
+};
+
+/* an open container, its items wait on the value stacks from base */
+struct parse_frame_t
+{
+  json_t *json;
+  size_t base;
+  mstr_t key;
+};
+
+/* callbacks see strings without escapes in place, others in scratch */
+struct sax_t
+{
+  parser_t p;
+  const json_sax_handler_t *h;
+  void *ctx;
+};
+
+enum
+{
+  PUSH_VALUE,
+  PUSH_VALUE_OR_END,
+  PUSH_KEY,
+  PUSH_KEY_OR_END,
+  PUSH_COLON,
+  PUSH_NEXT,
+  PUSH_DONE,
+};
+
+enum
+{
+  TOKEN_NONE,
+  TOKEN_KEY,
+  TOKEN_STRING,
+  TOKEN_SCALAR,
+};
+
+/* containers stay on the stack until closed, then join their parent */
+struct push_frame_t
+{
+  json_t *json;
+  mstr_t key;
+};
+
+enum
+{
+  QUERY_KEY = 1,
+  QUERY_INDEX = 2,
+};
 
-static void skip_ws (const char **psrc);
+/* a pointer token that reads as an index matches both ways */
+struct query_edge_t
+{
+  mstr_t key;
+  size_t index;
+  int kind;
+  uint32_t node;
+};
+
+/* first is the head of the expressions ending here, linked by next */
+struct query_node_t
+{
+  array_t edges;
+  uint32_t first;
+};
 
-static json_t *parse (const char **psrc);
-static json_t *parse_const (const char **psrc);
-static json_t *parse_array (const char **psrc);
-static json_t *parse_number (const char **psrc);
-static json_t *parse_string (const char **psrc);
-static json_t *parse_object (const char **psrc);
+/* the trie of all expressions, node 0 is the document root */
+struct json_query_t
+{
+  array_t nodes;
+  uint32_t *next;
+  size_t count;
+  size_t targets;
+};
+
+/* seen marks nodes whose member was scanned, so repeated keys are
+   skipped and every path follows the first occurrence */
+struct query_run_t
+{
+  const json_query_t *q;
+  json_t **results;
+  bool *seen;
+  size_t left;
+  mstr_t scratch;
+};
+
+/* a token split by a chunk boundary is gathered in pending */
+struct json_parser_t
+{
+  int state;
+  int token;
+  bool escape;
+  bool failed;
+  mstr_t pending;
+  array_t stack;
+  json_t *root;
+};
+
+struct line_t
+{
+  const json_t *json;
+  size_t offset;
+};
 
-static bool stringify (mstr_t *mstr, const json_t *json);
-static bool stringify_const (mstr_t *mstr, const json_t *json);
-static bool stringify_array (mstr_t *mstr, const json_t *json);
-static bool stringify_number (mstr_t *mstr, const json_t *json);
-static bool stringify_string (mstr_t *mstr, const json_t *json);
-static bool stringify_object (mstr_t *mstr, const json_t *json);
+/* a run of whole lines decoded by one worker into its own arena */
+struct lines_chunk_t
+{
+  const char *src;
+  const char *end;
+  arena_t arena;
+  array_t lines;
+  lines_chunk_t *link;
+  bool done;
+};
+
+/* workers claim chunks atomically and decode them unlocked; the lock
+   only guards handing finished chunks to the one worker delivering,
+   which runs the callbacks with it released */
+struct lines_t
+{
+  const char *buf;
+  lines_chunk_t *chunks;
+  lines_chunk_t *ready;
+  size_t count;
+  size_t claim;
+  size_t next;
+  int flags;
+  bool failed;
+  bool delivering;
+  json_line_t *cb;
+  void *ctx;
+  pthread_mutex_t lock;
+};
+
+/* consecutive elements of the top-level array, parsed by one worker */
+struct split_range_t
+{
+  const char *src;
+  const char *end;
+  array_t items;
+  bool ok;
+};
 
-static void array_free (array_t *array);
-static void object_free (rbtree_t *tree);
+struct split_t
+{
+  split_range_t *ranges;
+  size_t count;
+  size_t claim;
+};
+
+/* a span of serially encoded text, or items [from, to) of a container
+   (the whole value when json is a leaf) encoded by a worker into out */
+struct plan_part_t
+{
+  const json_t *json;
+  size_t from;
+  size_t to;
+  size_t text;
+  size_t len;
+  mstr_t out;
+  bool whole;
+  bool ok;
+};
+
+struct plan_t
+{
+  encoder_t e;
+  mstr_t text;
+  array_t parts;
+  size_t chunks;
+  size_t claim;
+};
+
+#define SAX_CALL(s, cb, ...)                                                  \
+  (!(s)->h->cb || (s)->h->cb ((s)->ctx, ##__VA_ARGS__))
+
+static void parser_init (parser_t *p, const char *src, size_t len,
+			 arena_t *arena);
+static bool parser_index (parser_t *p, structural_t *index);
+static void parser_free (parser_t *p);
+static inline void skip_ws (parser_t *p);
+static inline const char *scan_string (const char *src, const char *end,
+				       bool ascii);
+
+static json_t *parse_root (parser_t *p);
+static json_t *parse (parser_t *p);
+static json_t *parse_tape (parser_t *p);
+static json_t *parse_const (parser_t *p);
+static json_t *parse_number (parser_t *p);
+static json_t *parse_string (parser_t *p);
+
+static bool push_step (json_parser_t *p, const char **psrc,
+		       const char *end);
+static bool push_token (json_parser_t *p, const char *src, const char *end);
+static const char *token_scan (json_parser_t *p, const char *src,
+			       const char *end);
+
+static int worker_count (int nthreads);
+static void run_workers (void *(*fn) (void *), void *ctx, int nthreads,
+			 size_t tasks);
+static void *lines_worker (void *arg);
+static void *split_worker (void *arg);
+static bool plan_node (plan_t *plan, const json_t *json, int depth);
+static void *plan_worker (void *arg);
+
+static bool sax_parse (sax_t *s);
+static bool sax_open (sax_t *s, int type);
+static bool sax_close (sax_t *s);
+static bool sax_scalar (sax_t *s);
+static bool sax_string (sax_t *s, json_sax_string_t *cb);
+
+static encoder_flush_t flush_mstr;
+static encoder_flush_t flush_none;
+static encoder_flush_t flush_count;
+static encoder_flush_t flush_stream;
+
+static inline bool emit_char (encoder_t *e, char ch);
+
+static json_writer_t write_fd;
+static json_writer_t write_file;
+
+static bool stringify (encoder_t *e, const json_t *json);
+static bool stringify_const (encoder_t *e, const json_t *json);
+static bool stringify_number (encoder_t *e, const json_t *json);
+static bool stringify_string (encoder_t *e, const mstr_t *str);
+
+static void walk_init (walk_t *w);
+static bool walk_push (walk_t *w, const json_t *json);
+static void walk_free (walk_t *w);
+static size_t walk_size (const json_t *json);
+static void json_release (json_t *json);
+static void free_item (walk_t *w, json_t *json);
+static void free_reversed (json_t *json);
 static bool array_expand (array_t *array);
-static bool next_string (mstr_t *mstr, const char **psrc);
-static int pair_comp (const rbtree_node_t *a, const rbtree_node_t *b);
+static bool object_expand (json_object_t *object);
+static bool object_reindex (json_object_t *object, arena_t *arena);
+static void index_insert (json_index_t *index, uint64_t hash, uint32_t at);
+static uint32_t *index_locate (json_index_t *index, uint64_t hash,
+			       uint32_t at);
+static void index_erase (json_index_t *index, uint64_t hash, uint32_t at);
+static void index_move (json_index_t *index, const mstr_t *key,
+			uint32_t from, uint32_t to);
+static void object_compact (json_object_t *object);
+static uint64_t hash_key (const char *key, size_t len);
+static void key_probe (json_key_t *key, const char *data, size_t len);
+static json_pair_t *pairs_scan (json_pair_t *pairs, size_t size,
+				const json_key_t *key);
+static json_pair_t *index_find (const json_object_t *object, const char *key,
+				size_t len, uint64_t hash);
+static json_pair_t *object_find (const json_object_t *object, const char *key,
+				 size_t len);
+static bool json_init (json_t *json, int type);
+static bool next_string (mstr_t *mstr, const char **psrc, const char *end);
+
+static inline const char *scan_ws (const char *src, const char *end);
+static inline const char *skip_space (const char *src, const char *end);
+static const char *skip_value (const char *src, const char *end);
+static const char *key_span (const char *src, const char *end,
+			     mstr_t *scratch, const char **key, size_t *len);
+static const char *cursor_key (const char *src, const char *end,
+			       const char *key, size_t len, bool *hit);
+static bool pointer_token (mstr_t *out, const char *src, size_t len);
+static bool pointer_index (const char *token, size_t len, size_t *index);
+static bool pointer_step (json_cursor_t *cur, const char *token,
+			  size_t len);
+static bool query_add (json_query_t *q, const char *expr, uint32_t id);
+static const char *query_scan (query_run_t *r, uint32_t at,
+			       const char *src, const char *end);
+static void query_walk (const json_query_t *q, uint32_t at,
+			const json_t *json, const json_t **results);
 
 json_t *
 json_new (int type)
@@ -42,33 +435,8 @@ json_new (int type)
   if (!(new = malloc (sizeof (json_t))))
     return NULL;
 
-  switch (new->type = type)
+  if (!json_init (new, type))
     {
-    case JSON_NULL:
-      break;
-
-    case JSON_BOOL:
-      new->data.boolean = false;
-      break;
-
-    case JSON_ARRAY:
-      new->data.array = ARRAY_INIT;
-      new->data.array.element = sizeof (json_t *);
-      break;
-
-    case JSON_NUMBER:
-      new->data.number = 0;
-      break;
-
-    case JSON_STRING:
-      new->data.string = MSTR_INIT;
-      break;
-
-    case JSON_OBJECT:
-      new->data.object = RBTREE_INIT;
-      break;
-
-    default:
       free (new);
       return NULL;
     }
@@ -79,736 +447,4336 @@ json_new (int type)
 void
 json_free (json_t *json)
 {
+  walk_t w;
+
   if (!json)
     return;
 
-  switch (json->type)
-    {
-    case JSON_STRING:
-      mstr_free (&json->data.string);
-      break;
+  /* the same traversal stack as stringify, visiting items in order */
+  walk_init (&w);
+  free_item (&w, json);
 
-    case JSON_ARRAY:
-      array_free (&json->data.array);
-      break;
+  while (w.size)
+    {
+      walk_frame_t *top = w.frames + w.size - 1;
+      json_t *parent = (json_t *) top->json;
+      size_t i = top->next++;
 
-    case JSON_OBJECT:
-      object_free (&json->data.object);
+      if (i == walk_size (parent))
+	{
+	  w.size--;
+	  json_release (parent);
+	}
+      else if (parent->type == JSON_ARRAY)
+	free_item (&w, ((json_t **) parent->data.array.data)[i]);
+      else
+	{
+	  mstr_free (&parent->data.object.pairs[i].key);
+	  free_item (&w, parent->data.object.pairs[i].value);
+	}
     }
 
-  free (json);
+  walk_free (&w);
 }
 
 json_t *
 json_decode (const char *src)
 {
-  skip_ws (&src);
-  return parse (&src);
+  return json_decode_n (src, strlen (src), NULL);
 }
 
-mstr_t *
-json_encode (mstr_t *mstr, const json_t *json)
+json_t *
+json_decode_n (const char *src, size_t len, size_t *consumed)
 {
-  if (!stringify (mstr, json))
-    return NULL;
-  return mstr;
+  return json_decode_ex (src, len, consumed, 0, 0);
 }
 
-bool
-json_array_add (json_t *json, json_t *new)
+json_t *
+json_decode_ex (const char *src, size_t len, size_t *consumed, int flags,
+		size_t max_depth)
 {
-  array_t *array = &json->data.array;
-  if (!array_expand (array))
-    return false;
+  json_t *ret;
+  parser_t p;
 
-  json_t **inpos = array_push_back (array);
-  *inpos = new;
-  return true;
+  parser_init (&p, src, len, NULL);
+  p.max_depth = max_depth;
+  p.flags = flags;
+
+  if ((ret = parse_root (&p)) && consumed)
+    *consumed = p.src - src;
+
+  parser_free (&p);
+  return ret;
 }
 
-json_t *
-json_array_take (json_t *json, size_t index)
+bool
+json_sax_parse (const char *src, size_t len,
+		const json_sax_handler_t *handler, void *ctx)
 {
-  json_t *ret;
-  if ((ret = json_array_get (json, index)))
-    array_erase (&json->data.array, index);
+  return json_sax_parse_ex (src, len, handler, ctx, JSON_DEPTH_UNLIMITED);
+}
+
+bool
+json_sax_parse_ex (const char *src, size_t len,
+		   const json_sax_handler_t *handler, void *ctx,
+		   size_t max_depth)
+{
+  sax_t s = { .h = handler, .ctx = ctx };
+  bool ret;
+
+  parser_init (&s.p, src, len, NULL);
+  s.p.max_depth = max_depth;
+
+  /* a sax frame only records which kind of container is open */
+  s.p.frames.element = sizeof (int);
+
+  skip_ws (&s.p);
+  ret = sax_parse (&s);
+
+  parser_free (&s.p);
   return ret;
 }
 
-json_t *
-json_array_get (const json_t *json, size_t index)
+json_parser_t *
+json_parser_new (void)
 {
-  const array_t *array = &json->data.array;
-  json_t **ptr = array_at (array, index);
-  return ptr ? *ptr : NULL;
+  json_parser_t *p;
+
+  if (!(p = calloc (1, sizeof (json_parser_t))))
+    return NULL;
+
+  p->stack.element = sizeof (push_frame_t);
+  return p;
 }
 
 bool
-json_object_add (json_t *json, json_pair_t *new)
+json_parser_feed (json_parser_t *p, const char *chunk, size_t len)
 {
-  int comp_ret = 0;
-  rbtree_node_t **inpos;
-  rbtree_node_t *parent = NULL;
+  const char *src = chunk;
+  const char *end = chunk + len;
 
-  rbtree_node_t *node = &new->node;
-  rbtree_t *tree = &json->data.object;
+  if (p->failed)
+    return false;
 
-  for (rbtree_node_t *curr = tree->root; curr;)
+  /* complete a token split by the previous chunk */
+  if (p->token)
     {
-      comp_ret = pair_comp (node, curr);
+      const char *stop = token_scan (p, src, end);
 
-      if (unlikely (comp_ret == 0))
-	return false;
+      if (!mstr_cat_byte (&p->pending, src, (stop ? stop : end) - src))
+	goto err;
+
+      if (!stop)
+	return true;
 
-      parent = curr;
-      curr = comp_ret < 0 ? curr->left : curr->right;
+      src = stop;
+      stop = mstr_data (&p->pending) + mstr_len (&p->pending);
+
+      if (!push_token (p, mstr_data (&p->pending), stop))
+	goto err;
     }
 
-  inpos = comp_ret ? (comp_ret < 0 ? &parent->left : &parent->right)
-		   : &tree->root;
+  for (;;)
+    {
+      src = skip_space (src, end);
 
-  rbtree_link (tree, inpos, parent, node);
+      /* bytes after the root value are ignored, as json_decode does */
+      if (src >= end || p->state == PUSH_DONE)
+	return true;
 
-  return true;
-}
+      if (!push_step (p, &src, end))
+	goto err;
+    }
 
-json_pair_t *
-json_object_take (json_t *json, const char *key)
-{
-  json_pair_t *ret;
-  if ((ret = json_object_get (json, key)))
-    rbtree_erase (&json->data.object, &ret->node);
-  return ret;
+err:
+  p->failed = true;
+  return false;
 }
 
-json_pair_t *
-json_object_get (const json_t *json, const char *key)
+json_t *
+json_parser_finish (json_parser_t *p)
 {
-  json_pair_t target = { .key = MSTR_VIEW (key, strlen (key)) };
-  rbtree_node_t *node = &target.node;
+  json_t *ret;
 
-  for (rbtree_node_t *curr = json->data.object.root; curr;)
-    {
-      int comp_ret = pair_comp (node, curr);
+  if (p->failed)
+    return NULL;
 
-      if (comp_ret == 0)
-	return container_of (curr, json_pair_t, node);
+  /* the end of input terminates a split number or literal */
+  if (p->token == TOKEN_SCALAR)
+    {
+      const char *src = mstr_data (&p->pending);
 
-      curr = comp_ret < 0 ? curr->left : curr->right;
+      if (!push_token (p, src, src + mstr_len (&p->pending)))
+	{
+	  p->failed = true;
+	  return NULL;
+	}
     }
 
-  return NULL;
+  if (p->state != PUSH_DONE)
+    return NULL;
+
+  ret = p->root;
+  p->root = NULL;
+  return ret;
 }
 
-static void
-skip_ws (const char **psrc)
+void
+json_parser_free (json_parser_t *p)
 {
-  const char *src = *psrc;
+  if (!p)
+    return;
 
-  for (char ch; isspace (ch = *src);)
-    src++;
+  for (size_t i = 0; i < p->stack.size; i++)
+    {
+      push_frame_t *frame = (push_frame_t *) p->stack.data + i;
+      json_free (frame->json);
+      mstr_free (&frame->key);
+    }
 
-  *psrc = src;
+  free (p->stack.data);
+  mstr_free (&p->pending);
+  json_free (p->root);
+  free (p);
 }
 
-static json_t *
-parse (const char **psrc)
+bool
+json_decode_lines (const char *buf, size_t len, int nthreads, int flags,
+		   json_line_t *cb, void *ctx)
 {
-  switch (**psrc)
+  lines_t l = { .buf = buf, .flags = flags, .cb = cb, .ctx = ctx };
+  const char *src = buf;
+  const char *end = buf + len;
+
+  if (!(l.chunks = calloc (len / LINES_CHUNK_LEN + 1, sizeof (lines_chunk_t))))
+    return false;
+
+  /* cut after the first newline past each chunk length */
+  for (const char *next; src < end; src = next)
     {
-    case '+':
-    case '-':
-    case '0' ... '9':
-      return parse_number (psrc);
+      const char *eol = NULL;
 
-    case '"':
-      return parse_string (psrc);
+      if ((size_t) (end - src) > LINES_CHUNK_LEN)
+	eol = memchr (src + LINES_CHUNK_LEN, '\n',
+		      end - src - LINES_CHUNK_LEN);
 
-    case '{':
-      return parse_object (psrc);
+      next = eol ? eol + 1 : end;
+      l.chunks[l.count++] = (lines_chunk_t) { .src = src, .end = next };
+    }
 
-    case '[':
-      return parse_array (psrc);
+  pthread_mutex_init (&l.lock, NULL);
+  run_workers (lines_worker, &l, nthreads, l.count);
 
-    case 'f':
-    case 't':
-    case 'n':
-      return parse_const (psrc);
+  /* chunks left undelivered after a failure */
+  for (size_t i = 0; i < l.count; i++)
+    {
+      arena_free (&l.chunks[i].arena);
+      free (l.chunks[i].lines.data);
     }
 
-  return NULL;
+  pthread_mutex_destroy (&l.lock);
+  free (l.chunks);
+  return !l.failed;
 }
 
-#define JSON_NEW(TYPE)                                                        \
-  ({                                                                          \
-    json_t *ret;                                                              \
-    if (!(ret = json_new (TYPE)))                                             \
-      return NULL;                                                            \
-    ret;                                                                      \
-  })
-
-static json_t *
-parse_const (const char **psrc)
+json_t *
+json_decode_parallel (const char *src, size_t len, int nthreads)
 {
-  json_t *ret = JSON_NEW (JSON_BOOL);
-  const char *target = NULL;
-  size_t len = 0;
+  const char *end = src + len;
+  const char *at = skip_space (src, end);
+  array_t ranges = { .element = sizeof (split_range_t) };
+  split_range_t *range;
+  json_t *ret = NULL;
+  size_t total = 0;
+
+  nthreads = worker_count (nthreads);
 
-  switch (**psrc)
+  if (nthreads <= 1 || at >= end || *at != '[')
+    return json_decode_n (src, len, NULL);
+
+  size_t target = len / (nthreads * 8);
+  if (target < SPLIT_RANGE_MIN)
+    target = SPLIT_RANGE_MIN;
+
+  /* find element boundaries without parsing, cutting a range at the
+     first comma past the target length */
+  const char *start = at = skip_space (at + 1, end);
+
+  if (at < end && *at == ']')
+    return json_decode_n (src, len, NULL);
+
+  for (;;)
     {
-    case 'f':
-      ret->data.boolean = false;
-      target = "false";
-      len = 5;
-      break;
+      if (!(at = skip_value (at, end)))
+	goto out;
 
-    case 't':
-      ret->data.boolean = true;
-      target = "true";
-      len = 4;
-      break;
+      at = skip_space (at, end);
+      if (at >= end || (*at != ',' && *at != ']'))
+	goto out;
 
-    case 'n':
-      ret->type = JSON_NULL;
-      target = "null";
-      len = 4;
-      break;
+      if (*at == ',' && (size_t) (at - start) < target)
+	{
+	  at = skip_space (at + 1, end);
+	  continue;
+	}
+
+      if (!array_expand (&ranges))
+	goto out;
+
+      range = array_push_back (&ranges);
+      *range = (split_range_t) { .src = start, .end = at };
+
+      if (*at == ']')
+	break;
+
+      start = at = skip_space (at + 1, end);
     }
 
-  if (memcmp (*psrc, target, len) != 0)
-    goto err;
+  split_t split = { .ranges = ranges.data, .count = ranges.size };
 
-  *psrc += len;
-  return ret;
+  run_workers (split_worker, &split, nthreads, split.count);
 
-err:
-  free (ret);
-  return NULL;
-}
+  for (size_t i = 0; i < split.count; i++)
+    {
+      if (!split.ranges[i].ok)
+	goto out;
+      total += split.ranges[i].items.size;
+    }
+
+  /* stitch the ranges with one exact-size copy */
+  if (!(ret = json_new (JSON_ARRAY)))
+    goto out;
 
-static json_t *
-parse_array (const char **psrc)
-{
-  json_t *ret = JSON_NEW (JSON_ARRAY);
   array_t *array = &ret->data.array;
+  if (total && !(array->data = malloc (total * sizeof (json_t *))))
+    {
+      json_free (ret);
+      ret = NULL;
+      goto out;
+    }
 
-  *psrc += 1;
-  skip_ws (psrc);
-  if (**psrc == ']')
+  for (size_t i = 0; i < split.count; i++)
     {
-      *psrc += 1;
-      return ret;
+      array_t *items = &split.ranges[i].items;
+      memcpy ((json_t **) array->data + array->size, items->data,
+	      items->size * sizeof (json_t *));
+      array->size += items->size;
+      items->size = 0;
     }
 
-  json_t *elem;
+  array->cap = total;
 
-  for (;;)
+out:
+  for (size_t i = 0; i < ranges.size; i++)
     {
-      if (!(elem = parse (psrc)))
-	goto err;
+      array_t *items = &((split_range_t *) ranges.data)[i].items;
+      for (size_t j = 0; j < items->size; j++)
+	json_free (((json_t **) items->data)[j]);
+      free (items->data);
+    }
 
-      if (!json_array_add (ret, elem))
-	goto err2;
+  free (ranges.data);
+  return ret;
+}
 
-      skip_ws (psrc);
+json_doc_t *
+json_decode_arena (const char *src)
+{
+  return json_decode_arena_n (src, strlen (src), NULL);
+}
 
-      switch (**psrc)
-	{
-	case ',':
-	  *psrc += 1;
-	  skip_ws (psrc);
-	  break;
+json_doc_t *
+json_decode_arena_n (const char *src, size_t len, size_t *consumed)
+{
+  return json_decode_arena_ex (src, len, consumed, 0, 0);
+}
 
-	case ']':
-	  *psrc += 1;
-	  return ret;
+json_doc_t *
+json_decode_arena_ex (const char *src, size_t len, size_t *consumed,
+		      int flags, size_t max_depth)
+{
+  structural_t index = STRUCTURAL_INIT;
+  json_t *root;
+  json_doc_t *doc;
+  arena_t arena = ARENA_INIT;
+  parser_t p;
 
-	default:
-	  goto err;
-	}
-    }
+  parser_init (&p, src, len, &arena);
+  p.max_depth = max_depth;
+  p.flags = flags;
 
-err2:
-  json_free (elem);
+  if ((flags & JSON_DECODE_FAST) && !parser_index (&p, &index))
+    goto err;
+
+  if (!(doc = arena_alloc (&arena, sizeof (json_doc_t))))
+    goto err;
+
+  if (!(root = parse_root (&p)))
+    goto err;
+
+  if (consumed)
+    *consumed = p.src - src;
+
+  parser_free (&p);
+  structural_free (&index);
+  doc->root = root;
+  doc->arena = arena;
+  return doc;
 
 err:
-  array_free (array);
-  free ((void *) ret);
+  parser_free (&p);
+  structural_free (&index);
+  arena_free (&arena);
   return NULL;
 }
 
-static json_t *
-parse_number (const char **psrc)
+void
+json_doc_free (json_doc_t *doc)
 {
-  const char *src = *psrc;
-  json_t *ret = JSON_NEW (JSON_NUMBER);
+  if (!doc)
+    return;
+
+  arena_t arena = doc->arena;
+  arena_free (&arena);
+}
+
+mstr_t *
+json_encode (mstr_t *mstr, const json_t *json)
+{
+  return json_encode_ex (mstr, json, 0);
+}
 
-  char *end = (char *) src;
-  ret->data.number = strtod (src, &end);
+mstr_t *
+json_encode_ex (mstr_t *mstr, const json_t *json, int flags)
+{
+  char *data = mstr_data (mstr);
+  size_t len = mstr_len (mstr);
+
+  encoder_t e = {
+    .pos = data + len,
+    .end = data + mstr_cap (mstr) - 1,
+    .flags = flags,
+    .ctx = mstr,
+    .flush = flush_mstr,
+  };
+
+  if (!stringify (&e, json))
+    {
+      mstr_set_len (mstr, len);
+      return NULL;
+    }
+
+  mstr_set_len (mstr, e.pos - mstr_data (mstr));
+  return mstr;
+}
+
+mstr_t *
+json_encode_lines (mstr_t *mstr, const json_t *const *items, size_t n)
+{
+  char *data = mstr_data (mstr);
+  size_t len = mstr_len (mstr);
+
+  /* one encoder across all records */
+  encoder_t e = {
+    .pos = data + len,
+    .end = data + mstr_cap (mstr) - 1,
+    .ctx = mstr,
+    .flush = flush_mstr,
+  };
+
+  for (size_t i = 0; i < n; i++)
+    if (!stringify (&e, items[i]) || !emit_char (&e, '\n'))
+      {
+	mstr_set_len (mstr, len);
+	return NULL;
+      }
+
+  mstr_set_len (mstr, e.pos - mstr_data (mstr));
+  return mstr;
+}
+
+mstr_t *
+json_encode_parallel (mstr_t *mstr, const json_t *json, int nthreads)
+{
+  plan_t plan = { .text = MSTR_INIT };
+  mstr_t *ret = NULL;
+  size_t total = 0;
+
+  nthreads = worker_count (nthreads);
+
+  if (nthreads <= 1
+      || (json->type != JSON_ARRAY && json->type != JSON_OBJECT))
+    return json_encode (mstr, json);
+
+  /* lay out the top of the tree serially and hand out the rest */
+  plan.parts.element = sizeof (plan_part_t);
+  plan.chunks = nthreads * 4;
+  plan.e = (encoder_t) {
+    .pos = mstr_data (&plan.text),
+    .end = mstr_data (&plan.text) + mstr_cap (&plan.text) - 1,
+    .ctx = &plan.text,
+    .flush = flush_mstr,
+  };
+
+  if (!plan_node (&plan, json, 0))
+    goto out;
+
+  mstr_set_len (&plan.text, plan.e.pos - mstr_data (&plan.text));
+
+  plan_part_t *parts = plan.parts.data;
+  size_t count = plan.parts.size;
+
+  run_workers (plan_worker, &plan, nthreads, count);
+
+  for (size_t i = 0; i < count; i++)
+    {
+      if (parts[i].json && !parts[i].ok)
+	goto out;
+      total += parts[i].json ? mstr_len (&parts[i].out) : parts[i].len;
+    }
+
+  /* join everything with one exact-size copy */
+  size_t len = mstr_len (mstr);
+
+  if (!mstr_reserve (mstr, len + total + 1))
+    goto out;
+
+  char *pos = mstr_data (mstr) + len;
+
+  for (size_t i = 0; i < count; i++)
+    if (parts[i].json)
+      {
+	memcpy (pos, mstr_data (&parts[i].out), mstr_len (&parts[i].out));
+	pos += mstr_len (&parts[i].out);
+      }
+    else
+      {
+	memcpy (pos, mstr_data (&plan.text) + parts[i].text, parts[i].len);
+	pos += parts[i].len;
+      }
+
+  *pos = '\0';
+  mstr_set_len (mstr, len + total);
+  ret = mstr;
+
+out:
+  for (size_t i = 0; i < plan.parts.size; i++)
+    mstr_free (&((plan_part_t *) plan.parts.data)[i].out);
+
+  free (plan.parts.data);
+  mstr_free (&plan.text);
+  return ret;
+}
+
+size_t
+json_encoded_size (const json_t *json)
+{
+  char scratch[ENCODE_SCRATCH_LEN];
+
+  encoder_t e = {
+    .pos = scratch,
+    .end = scratch + ENCODE_SCRATCH_LEN,
+    .start = scratch,
+    .flush = flush_count,
+  };
+
+  if (!stringify (&e, json))
+    return 0;
+
+  return e.size + (e.pos - e.start);
+}
+
+bool
+json_encode_stream (const json_t *json, json_writer_t *write, void *ctx)
+{
+  char scratch[ENCODE_STREAM_LEN];
+  stream_t stream = { .write = write, .ctx = ctx };
+
+  encoder_t e = {
+    .pos = scratch,
+    .end = scratch + ENCODE_STREAM_LEN,
+    .start = scratch,
+    .ctx = &stream,
+    .flush = flush_stream,
+  };
+
+  if (!stringify (&e, json))
+    return false;
+
+  return flush_stream (&e, 0);
+}
+
+bool
+json_encode_fd (const json_t *json, int fd)
+{
+  return json_encode_stream (json, write_fd, &fd);
+}
+
+bool
+json_encode_file (const json_t *json, FILE *file)
+{
+  return json_encode_stream (json, write_file, file);
+}
+
+size_t
+json_encode_buf (char *buf, size_t cap, const json_t *json)
+{
+  encoder_t e = {
+    .pos = buf,
+    .end = buf + cap,
+    .flush = flush_none,
+  };
+
+  if (!stringify (&e, json))
+    return 0;
+
+  return e.pos - buf;
+}
+
+bool
+json_array_add (json_t *json, json_t *new)
+{
+  array_t *array = &json->data.array;
+  if (!array_expand (array))
+    return false;
+
+  json_t **inpos = array_push_back (array);
+  *inpos = new;
+  return true;
+}
+
+json_t *
+json_array_take (json_t *json, size_t index)
+{
+  json_t *ret;
+  if ((ret = json_array_get (json, index)))
+    array_erase (&json->data.array, index);
+  return ret;
+}
+
+json_t *
+json_array_get (const json_t *json, size_t index)
+{
+  const array_t *array = &json->data.array;
+  json_t **ptr = array_at (array, index);
+  return ptr ? *ptr : NULL;
+}
+
+bool
+json_object_add (json_t *json, json_pair_t *new)
+{
+  json_object_t *object = &json->data.object;
+  const mstr_t *str = &new->key;
+
+  if (unlikely (object_find (object, mstr_data (str), mstr_len (str))))
+    return false;
+
+  if (object->size == object->cap && !object_expand (object))
+    return false;
+
+  /* tombstones count against the load factor too */
+  json_index_t *index = object->index;
+  if (index && object->size + index->deleted >= (index->mask + 1) / 8 * 7
+      && !object_reindex (object, NULL))
+    return false;
+
+  str = &object->pairs[object->size].key;
+  object->pairs[object->size] = *new;
+
+  if (object->index)
+    {
+      uint64_t hash = hash_key (mstr_data (str), mstr_len (str));
+      index_insert (object->index, hash, object->size);
+    }
+
+  object->size++;
+
+  /* the pair now lives in the vector */
+  free (new);
+  return true;
+}
+
+bool
+json_object_take (json_t *json, const char *key, json_pair_t *out)
+{
+  json_object_t *object = &json->data.object;
+  json_pair_t *pair;
+
+  if (!(pair = json_object_get (json, key)))
+    return false;
+
+  *out = *pair;
+
+  json_pair_t *pairs = object->pairs;
+  json_index_t *index = object->index;
+  uint32_t at = pair - pairs;
+  uint32_t rest = object->size - at - 1;
+
+  object->size--;
+
+  if (!index)
+    {
+      memmove (pair, pair + 1, rest * sizeof (json_pair_t));
+      return true;
+    }
+
+  index_erase (index, hash_key (mstr_data (&pair->key),
+				mstr_len (&pair->key)), at);
+
+  /* the shorter side closes the gap; when it is the front, those pairs
+     move up one place and the vector starts one pair later, so each
+     keeps its position while every pair after the gap drops by one,
+     which raising base does for all of them at once */
+  if (at < rest)
+    {
+      for (uint32_t i = at; i-- > 0;)
+	index_move (index, &pairs[i].key, i, i + 1);
+
+      memmove (pairs + 1, pairs, at * sizeof (json_pair_t));
+      object->pairs++;
+      object->cap--;
+      index->front++;
+      index->base++;
+    }
+  else
+    {
+      for (uint32_t i = at + 1; i <= object->size; i++)
+	index_move (index, &pairs[i].key, i, i - 1);
+
+      memmove (pair, pair + 1, rest * sizeof (json_pair_t));
+    }
+
+  return true;
+}
+
+json_pair_t *
+json_object_get (const json_t *json, const char *key)
+{
+  return object_find (&json->data.object, key, strlen (key));
+}
+
+json_pair_t *
+json_object_get_n (const json_t *json, const char *key, size_t len)
+{
+  return object_find (&json->data.object, key, len);
+}
+
+json_pair_t *
+json_object_get_key (const json_t *json, const json_key_t *key)
+{
+  const json_object_t *object = &json->data.object;
+
+  if (!object->index)
+    return pairs_scan (object->pairs, object->size, key);
+
+  return index_find (object, key->data, key->len, key->hash);
+}
+
+json_key_t *
+json_key_init (json_key_t *key, const char *data, size_t len)
+{
+  key_probe (key, data, len);
+  key->hash = hash_key (data, len);
+  return key;
+}
+
+bool
+json_cursor_init (json_cursor_t *cur, const char *src, size_t len)
+{
+  const char *end = src + len;
+
+  src = skip_space (src, end);
+  *cur = (json_cursor_t) { .src = src, .end = end };
+  return src < end;
+}
+
+int
+json_cursor_type (const json_cursor_t *cur)
+{
+  number_t num;
+
+  if (cur->src >= cur->end)
+    return -1;
+
+  switch (*cur->src)
+    {
+    case '-':
+    case '0' ... '9':
+      if (!number_parse (cur->src, cur->end, &num))
+	return -1;
+      return num.type == NUMBER_INTEGER ? JSON_INTEGER
+	: num.type == NUMBER_UINT ? JSON_UINT : JSON_NUMBER;
+
+    case '"':
+      return JSON_STRING;
+
+    case '{':
+      return JSON_OBJECT;
+
+    case '[':
+      return JSON_ARRAY;
+
+    case 't':
+    case 'f':
+      return skip_value (cur->src, cur->end) ? JSON_BOOL : -1;
+
+    case 'n':
+      return skip_value (cur->src, cur->end) ? JSON_NULL : -1;
+    }
+
+  return -1;
+}
+
+bool
+json_cursor_field (const json_cursor_t *cur, const char *key,
+		   json_cursor_t *out)
+{
+  return json_cursor_field_n (cur, key, strlen (key), out);
+}
+
+bool
+json_cursor_field_n (const json_cursor_t *cur, const char *key, size_t len,
+		     json_cursor_t *out)
+{
+  const char *src = cur->src;
+  const char *end = cur->end;
+  bool hit;
+
+  if (src >= end || *src != '{')
+    return false;
+
+  src = skip_space (src + 1, end);
+  if (src < end && *src == '}')
+    return false;
+
+  for (;;)
+    {
+      if (!(src = cursor_key (src, end, key, len, &hit)))
+	return false;
+
+      src = skip_space (src, end);
+      if (src >= end || *src != ':')
+	return false;
+
+      src = skip_space (src + 1, end);
+      if (hit)
+	break;
+
+      if (!(src = skip_value (src, end)))
+	return false;
+
+      src = skip_space (src, end);
+      if (src >= end || *src != ',')
+	return false;
+
+      src = skip_space (src + 1, end);
+    }
+
+  *out = (json_cursor_t) { .src = src, .end = end };
+  return src < end;
+}
+
+bool
+json_cursor_index (const json_cursor_t *cur, size_t index,
+		   json_cursor_t *out)
+{
+  const char *src = cur->src;
+  const char *end = cur->end;
+
+  if (src >= end || *src != '[')
+    return false;
+
+  src = skip_space (src + 1, end);
+  if (src < end && *src == ']')
+    return false;
+
+  for (; index; index--)
+    {
+      if (!(src = skip_value (src, end)))
+	return false;
+
+      src = skip_space (src, end);
+      if (src >= end || *src != ',')
+	return false;
+
+      src = skip_space (src + 1, end);
+    }
+
+  *out = (json_cursor_t) { .src = src, .end = end };
+  return src < end;
+}
+
+bool
+json_cursor_get_bool (const json_cursor_t *cur, bool *out)
+{
+  const char *src = cur->src;
+
+  if (src >= cur->end || (*src != 't' && *src != 'f'))
+    return false;
+
+  if (skip_value (src, cur->end) == NULL)
+    return false;
+
+  *out = *src == 't';
+  return true;
+}
+
+bool
+json_cursor_get_number (const json_cursor_t *cur, double *out)
+{
+  number_t num;
+
+  if (cur->src >= cur->end || !number_parse (cur->src, cur->end, &num))
+    return false;
+
+  *out = num.type == NUMBER_INTEGER ? (double) num.integer
+    : num.type == NUMBER_UINT ? (double) num.uinteger : num.real;
+  return true;
+}
+
+bool
+json_cursor_get_integer (const json_cursor_t *cur, int64_t *out)
+{
+  number_t num;
+
+  if (cur->src >= cur->end || !number_parse (cur->src, cur->end, &num)
+      || num.type != NUMBER_INTEGER)
+    return false;
+
+  *out = num.integer;
+  return true;
+}
+
+bool
+json_cursor_get_uint (const json_cursor_t *cur, uint64_t *out)
+{
+  number_t num;
+
+  if (cur->src >= cur->end || !number_parse (cur->src, cur->end, &num))
+    return false;
+
+  if (num.type == NUMBER_UINT)
+    *out = num.uinteger;
+  else if (num.type == NUMBER_INTEGER && num.integer >= 0)
+    *out = num.integer;
+  else
+    return false;
+
+  return true;
+}
+
+bool
+json_cursor_get_string (const json_cursor_t *cur, mstr_t *out)
+{
+  const char *src = cur->src;
+
+  mstr_clear (out);
+  return next_string (out, &src, cur->end);
+}
+
+json_t *
+json_cursor_decode (const json_cursor_t *cur)
+{
+  return json_decode_n (cur->src, cur->end - cur->src, NULL);
+}
+
+bool
+json_extract (const char *src, size_t len, const char *pointer,
+	      json_t **out)
+{
+  mstr_t token = MSTR_INIT;
+  json_cursor_t cur;
+  bool ret = false;
+
+  *out = NULL;
+
+  if (*pointer && *pointer != '/')
+    return false;
+
+  if (!json_cursor_init (&cur, src, len))
+    return false;
+
+  /* each reference token narrows the cursor, only the target is built */
+  while (*pointer == '/')
+    {
+      const char *key = ++pointer;
+      size_t n = strcspn (key, "/");
+
+      pointer += n;
+
+      if (memchr (key, '~', n))
+	{
+	  if (!pointer_token (&token, key, n))
+	    goto err;
+
+	  key = mstr_data (&token);
+	  n = mstr_len (&token);
+	}
+
+      if (!pointer_step (&cur, key, n))
+	goto err;
+    }
+
+  ret = (*out = json_cursor_decode (&cur)) != NULL;
+
+err:
+  mstr_free (&token);
+  return ret;
+}
+
+json_query_t *
+json_query_compile (const char *const *exprs, size_t n)
+{
+  json_query_t *q;
+
+  if (n >= QUERY_NONE || !(q = calloc (1, sizeof (json_query_t))))
+    return NULL;
+
+  q->count = n;
+  q->nodes.element = sizeof (query_node_t);
+
+  if (!(q->next = malloc ((n ? n : 1) * sizeof (uint32_t))))
+    goto err;
+
+  if (!array_expand (&q->nodes))
+    goto err;
+
+  query_node_t *root = array_push_back (&q->nodes);
+  *root = (query_node_t) { .first = QUERY_NONE };
+  root->edges.element = sizeof (query_edge_t);
+
+  for (size_t i = 0; i < n; i++)
+    if (!query_add (q, exprs[i], i))
+      goto err;
+
+  return q;
+
+err:
+  json_query_free (q);
+  return NULL;
+}
+
+bool
+json_query_run (const json_query_t *query, const char *src, size_t len,
+		json_t **results)
+{
+  const char *end = src + len;
+  query_run_t r = {
+    .q = query,
+    .results = results,
+    .left = query->targets,
+    .scratch = MSTR_INIT,
+  };
+  bool ret;
+
+  for (size_t i = 0; i < query->count; i++)
+    results[i] = NULL;
+
+  if (!(r.seen = calloc (query->nodes.size, sizeof (bool))))
+    return false;
+
+  /* one pass that enters only subtrees on some expression's path */
+  ret = query_scan (&r, 0, skip_space (src, end), end) != NULL;
+
+  if (!ret)
+    for (size_t i = 0; i < query->count; i++)
+      {
+	json_free (results[i]);
+	results[i] = NULL;
+      }
+
+  mstr_free (&r.scratch);
+  free (r.seen);
+  return ret;
+}
+
+void
+json_query_eval (const json_query_t *query, const json_t *json,
+		 const json_t **results)
+{
+  for (size_t i = 0; i < query->count; i++)
+    results[i] = NULL;
+
+  query_walk (query, 0, json, results);
+}
+
+void
+json_query_free (json_query_t *query)
+{
+  if (!query)
+    return;
+
+  for (size_t i = 0; i < query->nodes.size; i++)
+    {
+      query_node_t *node = (query_node_t *) query->nodes.data + i;
+
+      for (size_t j = 0; j < node->edges.size; j++)
+	mstr_free (&((query_edge_t *) node->edges.data + j)->key);
+      free (node->edges.data);
+    }
+
+  free (query->nodes.data);
+  free (query->next);
+  free (query);
+}
+
+static void
+parser_init (parser_t *p, const char *src, size_t len, arena_t *arena)
+{
+  *p = (parser_t) {
+    .src = src,
+    .end = src + len,
+    .base = src,
+    .arena = arena,
+  };
+  p->frames.element = sizeof (parse_frame_t);
+  p->stack.element = sizeof (json_t *);
+  p->pairs.element = sizeof (json_pair_t);
+}
+
+static bool
+parser_index (parser_t *p, structural_t *index)
+{
+  size_t len = p->end - p->src;
+
+  /* structural offsets are 32-bit, larger inputs are scanned directly */
+  if (len > UINT32_MAX)
+    return true;
+
+  if (!structural_index (index, p->src, len))
+    return false;
+
+  p->tape = index->pos;
+  p->tape_end = index->pos + index->size;
+  return true;
+}
+
+static void
+parser_free (parser_t *p)
+{
+  free (p->frames.data);
+  free (p->stack.data);
+  free (p->pairs.data);
+  free (p->intern.slots);
+  mstr_free (&p->scratch);
+}
+
+static inline char
+peek (const parser_t *p)
+{
+  /* the end of input reads as NUL, which no token starts with */
+  return p->src < p->end ? *p->src : '\0';
+}
+
+static inline const char *
+tape_at (const parser_t *p)
+{
+  return p->tape < p->tape_end ? p->base + *p->tape : p->end;
+}
+
+static inline char
+tape_peek (const parser_t *p)
+{
+  return p->tape < p->tape_end ? p->base[*p->tape] : '\0';
+}
+
+/* moves to the next token on the tape and returns its first byte */
+static inline char
+tape_next (parser_t *p)
+{
+  p->src = tape_at (p);
+  p->tape += p->tape < p->tape_end;
+  return peek (p);
+}
+
+static inline void *
+parser_alloc (parser_t *p, size_t size)
+{
+  return p->arena ? arena_alloc (p->arena, size) : malloc (size);
+}
+
+static inline void
+parser_release (parser_t *p, json_t *json)
+{
+  /* arena nodes die with their document */
+  if (!p->arena)
+    json_free (json);
+}
+
+static bool
+parser_collect_array (parser_t *p, array_t *array, size_t base)
+{
+  array_t *stack = &p->stack;
+  size_t size = stack->size - base;
+  size_t bytes = size * sizeof (json_t *);
+  json_t **data;
+
+  if (!(data = parser_alloc (p, bytes)))
+    return false;
+
+  memcpy (data, (json_t **) stack->data + base, bytes);
+  array->data = data;
+  array->size = array->cap = size;
+  stack->size = base;
+  return true;
+}
+
+static bool
+parser_collect_object (parser_t *p, json_object_t *object, size_t base)
+{
+  array_t *stack = &p->pairs;
+  size_t size = stack->size - base;
+  size_t bytes = size * sizeof (json_pair_t);
+  json_pair_t *pairs;
+
+  if (size > UINT32_MAX || !(pairs = parser_alloc (p, bytes)))
+    return false;
+
+  memcpy (pairs, (json_pair_t *) stack->data + base, bytes);
+  object->pairs = pairs;
+  object->size = object->cap = size;
+
+  if (!object_reindex (object, p->arena))
+    {
+      /* duplicate keys, the stack still owns the pairs */
+      if (!p->arena)
+	free (pairs);
+      *object = (json_object_t) {};
+      return false;
+    }
+
+  stack->size = base;
+  return true;
+}
+
+static void
+parser_release_pairs (parser_t *p, size_t base)
+{
+  array_t *stack = &p->pairs;
+
+  if (!p->arena)
+    for (size_t i = base; i < stack->size; i++)
+      {
+	json_pair_t *pair = (json_pair_t *) stack->data + i;
+	json_free (pair->value);
+	mstr_free (&pair->key);
+      }
+
+  stack->size = base;
+}
+
+static bool
+parser_copy (parser_t *p, mstr_t *mstr, const char *data, size_t len)
+{
+  if (len < MSTR_SSO_CAP)
+    return mstr_assign_byte (mstr, data, len);
+
+  /* odd capacity keeps the heap flag set */
+  size_t cap = (len + 1) | MSTR_FLG_HEAP;
+  char *copy;
+
+  if (!(copy = arena_alloc (p->arena, cap)))
+    return false;
+
+  memcpy (copy, data, len);
+  copy[len] = '\0';
+
+  mstr->heap = (mstr_heap_t) { .cap = cap, .len = len, .data = copy };
+  return true;
+}
+
+static bool
+intern_expand (intern_t *intern)
+{
+  size_t cap = intern->cap;
+  mstr_t *slots, *old = intern->slots;
+
+  if (!(cap = cap * 2))
+    cap = INTERN_INIT_CAP;
+
+  if (!(slots = calloc (cap, sizeof (mstr_t))))
+    return false;
+
+  for (size_t i = 0; i < intern->cap; i++)
+    {
+      mstr_t *str = old + i;
+
+      if (mstr_is_sso (str))
+	continue;
+
+      size_t at = hash_key (str->heap.data, str->heap.len);
+      for (at &= cap - 1; mstr_is_heap (slots + at); at = (at + 1) & (cap - 1))
+	;
+      slots[at] = *str;
+    }
+
+  free (old);
+  intern->cap = cap;
+  intern->slots = slots;
+  return true;
+}
+
+static bool
+parser_intern (parser_t *p, mstr_t *mstr, const char *data, size_t len)
+{
+  intern_t *intern = &p->intern;
+
+  if (intern->size >= intern->cap / 8 * 7 && !intern_expand (intern))
+    return false;
+
+  size_t mask = intern->cap - 1;
+  size_t at = hash_key (data, len) & mask;
+  mstr_t *slot;
+
+  for (;; at = (at + 1) & mask)
+    {
+      slot = intern->slots + at;
+
+      if (mstr_is_sso (slot))
+	{
+	  if (!parser_copy (p, slot, data, len))
+	    return false;
+	  intern->size++;
+	  break;
+	}
+
+      if (slot->heap.len == len && memcmp (slot->heap.data, data, len) == 0)
+	break;
+    }
+
+  /* shares the bytes, the arena owns them */
+  *mstr = *slot;
+  return true;
+}
+
+static bool
+parser_span (parser_t *p, mstr_t *mstr, const char *data, size_t len,
+	     bool key)
+{
+  if (!p->arena)
+    return mstr_assign_byte (mstr, data, len);
+
+  if (key && len >= MSTR_SSO_CAP && (p->flags & JSON_DECODE_INTERN))
+    return parser_intern (p, mstr, data, len);
+
+  return parser_copy (p, mstr, data, len);
+}
+
+static bool
+parser_scan_string (parser_t *p, mstr_t *mstr, bool key)
+{
+  if (!p->arena)
+    return next_string (mstr, &p->src, p->end);
+
+  mstr_t *scratch = &p->scratch;
+  mstr_clear (scratch);
+
+  if (!next_string (scratch, &p->src, p->end))
+    return false;
+
+  return parser_span (p, mstr, mstr_data (scratch), mstr_len (scratch), key);
+}
+
+static bool
+parser_string (parser_t *p, mstr_t *mstr, bool key)
+{
+  if (!p->tape)
+    return parser_scan_string (p, mstr, key);
+
+  /* the opening quote is already off the tape; with no escapes or
+     control bytes between, the next entry is the closing quote */
+  const char *close = tape_at (p);
+
+  if (peek (p) == '"' && close < p->end && *close == '"')
+    {
+      const char *data = p->src + 1;
+
+      p->tape++;
+      p->src = close + 1;
+      return parser_span (p, mstr, data, close - data, key);
+    }
+
+  if (!parser_scan_string (p, mstr, key))
+    return false;
+
+  /* drop the entries inside the string */
+  for (size_t at = p->src - p->base; p->tape < p->tape_end && *p->tape < at;)
+    p->tape++;
+
+  return true;
+}
+
+static inline const char *
+scan_ws (const char *src, const char *end)
+{
+  /* stop at the first byte that is not JSON whitespace */
+#ifdef __AVX2__
+  for (; end - src >= 32; src += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) src);
+      __m256i ws = _mm256_or_si256 (
+	  _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')),
+			   _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n'))),
+	  _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')),
+			   _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r'))));
+      uint32_t mask = ~(uint32_t) _mm256_movemask_epi8 (ws);
+
+      if (mask)
+	return src + __builtin_ctz (mask);
+    }
+#endif
+
+#ifdef __SSE2__
+  for (; end - src >= 16; src += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i ws = _mm_or_si128 (
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+			_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n'))),
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')),
+			_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r'))));
+      uint32_t mask = ~_mm_movemask_epi8 (ws) & 0xffff;
+
+      if (mask)
+	return src + __builtin_ctz (mask);
+    }
+#endif
+
+  for (; src < end && is_ws[(unsigned char) *src];)
+    src++;
+
+  return src;
+}
+
+static inline void
+skip_ws (parser_t *p)
+{
+  const char *src = p->src;
+  const char *end = p->end;
+
+  /* tokens are mostly separated by no or a single whitespace byte */
+  if (src >= end || !is_ws[(unsigned char) *src])
+    return;
+
+  if (++src < end && is_ws[(unsigned char) *src])
+    src = scan_ws (src, end);
+
+  p->src = src;
+}
+
+#define JSON_NEW(TYPE)                                                        \
+  ({                                                                          \
+    json_t *ret;                                                              \
+    if (!(ret = parser_alloc (p, sizeof (json_t))))                           \
+      return NULL;                                                            \
+    json_init (ret, TYPE);                                                    \
+    ret;                                                                      \
+  })
+
+static json_t *
+parse_const (parser_t *p)
+{
+  json_t *ret = JSON_NEW (JSON_BOOL);
+  const char *target = NULL;
+  size_t len = 0;
+
+  switch (peek (p))
+    {
+    case 'f':
+      ret->data.boolean = false;
+      target = "false";
+      len = 5;
+      break;
+
+    case 't':
+      ret->data.boolean = true;
+      target = "true";
+      len = 4;
+      break;
+
+    case 'n':
+      ret->type = JSON_NULL;
+      target = "null";
+      len = 4;
+      break;
+    }
+
+  if ((size_t) (p->end - p->src) < len || memcmp (p->src, target, len) != 0)
+    goto err;
+
+  p->src += len;
+  return ret;
+
+err:
+  parser_release (p, ret);
+  return NULL;
+}
+
+static json_t *
+parse_number (parser_t *p)
+{
+  json_t *ret = JSON_NEW (JSON_NUMBER);
+  const char *end;
+  number_t num;
+
+  if (!(end = number_parse (p->src, p->end, &num)))
+    goto err;
+
+  if (num.type == NUMBER_INTEGER)
+    {
+      ret->type = JSON_INTEGER;
+      ret->data.integer = num.integer;
+    }
+  else if (num.type == NUMBER_UINT)
+    {
+      ret->type = JSON_UINT;
+      ret->data.uinteger = num.uinteger;
+    }
+  else
+    ret->data.number = num.real;
+
+  p->src = end;
+  return ret;
+
+err:
+  parser_release (p, ret);
+  return NULL;
+}
+
+static json_t *
+parse_string (parser_t *p)
+{
+  json_t *ret = JSON_NEW (JSON_STRING);
+  mstr_t *mstr = &ret->data.string;
+
+  if (!parser_string (p, mstr, false))
+    goto err;
+  return ret;
+
+err:
+  parser_release (p, ret);
+  return NULL;
+}
+
+#undef JSON_NEW
+
+static bool
+parse_open (parser_t *p, int type)
+{
+  array_t *frames = &p->frames;
+  json_t *json;
+
+  if (p->max_depth && frames->size >= p->max_depth)
+    return false;
+
+  if (!array_expand (frames))
+    return false;
+
+  if (!(json = parser_alloc (p, sizeof (json_t))))
+    return false;
+  json_init (json, type);
+
+  parse_frame_t *frame = array_push_back (frames);
+  *frame = (parse_frame_t) {
+    .json = json,
+    .base = type == JSON_ARRAY ? p->stack.size : p->pairs.size,
+    .key = MSTR_INIT,
+  };
+
+  p->src += 1;
+  return true;
+}
+
+static bool
+parse_attach (parser_t *p, parse_frame_t *frame, json_t *json)
+{
+  if (frame->json->type == JSON_ARRAY)
+    {
+      if (!array_expand (&p->stack))
+	return false;
+      *(json_t **) array_push_back (&p->stack) = json;
+      return true;
+    }
+
+  if (!array_expand (&p->pairs))
+    return false;
+
+  json_pair_t *pair = array_push_back (&p->pairs);
+  *pair = (json_pair_t) { .value = json, .key = frame->key };
+  frame->key = MSTR_INIT;
+  return true;
+}
+
+static bool
+parse_close (parser_t *p, parse_frame_t *frame)
+{
+  json_t *json = frame->json;
+  bool array = json->type == JSON_ARRAY;
+
+  p->src += 1;
+
+  /* empty containers keep the state json_init gave them */
+  if (frame->base == (array ? p->stack.size : p->pairs.size))
+    return true;
+
+  if (array)
+    return parser_collect_array (p, &json->data.array, frame->base);
+
+  return parser_collect_object (p, &json->data.object, frame->base);
+}
+
+static void
+parse_unwind (parser_t *p)
+{
+  array_t *frames = &p->frames;
+
+  /* the innermost containers hold the top of the value stacks */
+  for (size_t i = frames->size; i-- > 0;)
+    {
+      parse_frame_t *frame = (parse_frame_t *) frames->data + i;
+      array_t *stack = &p->stack;
+
+      if (frame->json->type == JSON_OBJECT)
+	parser_release_pairs (p, frame->base);
+      else
+	{
+	  for (size_t j = frame->base; j < stack->size; j++)
+	    parser_release (p, *(json_t **) array_at (stack, j));
+	  stack->size = frame->base;
+	}
+
+      if (!p->arena)
+	mstr_free (&frame->key);
+      parser_release (p, frame->json);
+    }
+
+  frames->size = 0;
+}
+
+static json_t *
+parse (parser_t *p)
+{
+  array_t *frames = &p->frames;
+  parse_frame_t *top;
+  json_t *json;
+
+  /* containers are opened and closed on the frame stack instead of the
+     call stack, so the nesting depth costs no C stack */
+value:
+  switch (peek (p))
+    {
+    case '-':
+    case '0' ... '9':
+      json = parse_number (p);
+      break;
+
+    case '"':
+      json = parse_string (p);
+      break;
+
+    case 'f':
+    case 't':
+    case 'n':
+      json = parse_const (p);
+      break;
+
+    case '[':
+      if (!parse_open (p, JSON_ARRAY))
+	goto err;
+      skip_ws (p);
+      if (peek (p) != ']')
+	goto value;
+      goto close;
+
+    case '{':
+      if (!parse_open (p, JSON_OBJECT))
+	goto err;
+      skip_ws (p);
+      if (peek (p) != '}')
+	goto key;
+      goto close;
+
+    default:
+      goto err;
+    }
+
+  if (!json)
+    goto err;
+
+next:
+  if (!frames->size)
+    return json;
+
+  top = array_last (frames);
+
+  if (!parse_attach (p, top, json))
+    {
+      parser_release (p, json);
+      goto err;
+    }
+
+  skip_ws (p);
+
+  switch (peek (p))
+    {
+    case ',':
+      p->src += 1;
+      skip_ws (p);
+      if (top->json->type == JSON_ARRAY)
+	goto value;
+      goto key;
+
+    case ']':
+      if (top->json->type != JSON_ARRAY)
+	goto err;
+      goto close;
+
+    case '}':
+      if (top->json->type != JSON_OBJECT)
+	goto err;
+      goto close;
+
+    default:
+      goto err;
+    }
+
+close:
+  top = array_last (frames);
+  if (!parse_close (p, top))
+    goto err;
+
+  json = top->json;
+  frames->size--;
+  goto next;
+
+key:
+  top = array_last (frames);
+  if (!parser_string (p, &top->key, true))
+    goto err;
+
+  skip_ws (p);
+  if (peek (p) != ':')
+    goto err;
+
+  p->src += 1;
+  skip_ws (p);
+  goto value;
+
+err:
+  parse_unwind (p);
+  return NULL;
+}
+
+static json_t *
+parse_root (parser_t *p)
+{
+  if (p->tape)
+    return parse_tape (p);
+
+  skip_ws (p);
+  return parse (p);
+}
+
+/* stage 2 of the fast decoder: tokens are taken from the tape in order,
+   so whitespace is never read and escape-free strings are copied
+   between their quotes; values are built exactly as parse builds them */
+static json_t *
+parse_tape (parser_t *p)
+{
+  array_t *frames = &p->frames;
+  parse_frame_t *top;
+  json_t *json;
+
+value:
+  switch (tape_next (p))
+    {
+    case '-':
+    case '0' ... '9':
+      json = parse_number (p);
+      break;
+
+    case '"':
+      json = parse_string (p);
+      break;
+
+    case 'f':
+    case 't':
+    case 'n':
+      json = parse_const (p);
+      break;
+
+    case '[':
+      if (!parse_open (p, JSON_ARRAY))
+	goto err;
+      if (tape_peek (p) != ']')
+	goto value;
+      tape_next (p);
+      goto close;
+
+    case '{':
+      if (!parse_open (p, JSON_OBJECT))
+	goto err;
+      if (tape_peek (p) != '}')
+	goto key;
+      tape_next (p);
+      goto close;
+
+    default:
+      goto err;
+    }
+
+  if (!json)
+    goto err;
+
+next:
+  if (!frames->size)
+    return json;
+
+  top = array_last (frames);
+
+  /* the rest of a scalar is not on the tape, so it must end where
+     whitespace or the next token starts */
+  if ((p->src != tape_at (p) && !is_ws[(unsigned char) peek (p)])
+      || !parse_attach (p, top, json))
+    {
+      parser_release (p, json);
+      goto err;
+    }
+
+  switch (tape_next (p))
+    {
+    case ',':
+      if (top->json->type == JSON_ARRAY)
+	goto value;
+      goto key;
+
+    case ']':
+      if (top->json->type != JSON_ARRAY)
+	goto err;
+      goto close;
+
+    case '}':
+      if (top->json->type != JSON_OBJECT)
+	goto err;
+      goto close;
+
+    default:
+      goto err;
+    }
+
+close:
+  top = array_last (frames);
+  if (!parse_close (p, top))
+    goto err;
+
+  json = top->json;
+  frames->size--;
+  goto next;
+
+key:
+  top = array_last (frames);
+  if (tape_next (p) != '"' || !parser_string (p, &top->key, true))
+    goto err;
+
+  if (tape_next (p) != ':')
+    goto err;
+  goto value;
+
+err:
+  parse_unwind (p);
+  return NULL;
+}
+
+static inline bool
+is_scalar (char ch)
+{
+  unsigned char lower = ch | 0x20;
+  return (lower >= 'a' && lower <= 'z') || (ch >= '0' && ch <= '9')
+	 || ch == '.' || ch == '+' || ch == '-';
+}
+
+static const char *
+token_scan (json_parser_t *p, const char *src, const char *end)
+{
+  /* returns the end of the token, or NULL when it runs past the chunk */
+  if (p->token == TOKEN_SCALAR)
+    {
+      for (; src < end && is_scalar (*src);)
+	src++;
+      return src < end ? src : NULL;
+    }
+
+  if (p->escape)
+    {
+      if (src >= end)
+	return NULL;
+      p->escape = false;
+      src++;
+    }
+
+  for (;;)
+    {
+      if ((src = scan_string (src, end, false)) >= end)
+	return NULL;
+
+      if (*src == '"')
+	return src + 1;
+
+      /* control characters are left for next_string to reject */
+      if (*src == '\\' && ++src >= end)
+	{
+	  p->escape = true;
+	  return NULL;
+	}
+
+      src++;
+    }
+}
+
+static inline bool
+push_literal (const char *src, size_t len, const char *lit, size_t n,
+	      bool root)
+{
+  /* a root value may be followed by anything, as in json_decode */
+  return (root ? len >= n : len == n) && memcmp (src, lit, n) == 0;
+}
+
+static json_t *
+push_scalar (const char *src, const char *end, bool root)
+{
+  size_t len = end - src;
+  json_t *ret = NULL;
+  const char *stop;
+  number_t num;
+
+  switch (*src)
+    {
+    case '-':
+    case '0' ... '9':
+      if (!(stop = number_parse (src, end, &num)) || (!root && stop != end))
+	return NULL;
+
+      if (num.type == NUMBER_INTEGER && (ret = json_new (JSON_INTEGER)))
+	ret->data.integer = num.integer;
+      else if (num.type == NUMBER_UINT && (ret = json_new (JSON_UINT)))
+	ret->data.uinteger = num.uinteger;
+      else if (num.type == NUMBER_REAL && (ret = json_new (JSON_NUMBER)))
+	ret->data.number = num.real;
+      return ret;
+
+    case 't':
+      if (push_literal (src, len, "true", 4, root)
+	  && (ret = json_new (JSON_BOOL)))
+	ret->data.boolean = true;
+      return ret;
+
+    case 'f':
+      if (push_literal (src, len, "false", 5, root)
+	  && (ret = json_new (JSON_BOOL)))
+	ret->data.boolean = false;
+      return ret;
+
+    case 'n':
+      if (push_literal (src, len, "null", 4, root))
+	ret = json_new (JSON_NULL);
+      return ret;
+    }
+
+  return NULL;
+}
+
+static bool
+push_value (json_parser_t *p, json_t *json)
+{
+  push_frame_t *top = array_last (&p->stack);
+  json_pair_t *pair;
+
+  if (!json)
+    return false;
+
+  if (!top)
+    {
+      p->root = json;
+      p->state = PUSH_DONE;
+      return true;
+    }
+
+  p->state = PUSH_NEXT;
+
+  if (json_is_array (top->json))
+    {
+      if (json_array_add (top->json, json))
+	return true;
+    }
+  else if ((pair = malloc (sizeof (json_pair_t))))
+    {
+      pair->key = top->key;
+      pair->value = json;
+
+      if (json_object_add (top->json, pair))
+	{
+	  top->key = MSTR_INIT;
+	  return true;
+	}
+
+      free (pair);
+    }
+
+  json_free (json);
+  return false;
+}
+
+static bool
+push_token (json_parser_t *p, const char *src, const char *end)
+{
+  int token = p->token;
+  json_t *json;
+
+  p->token = TOKEN_NONE;
+
+  if (token == TOKEN_SCALAR)
+    return push_value (p, push_scalar (src, end, p->stack.size == 0));
+
+  if (token == TOKEN_KEY)
+    {
+      push_frame_t *top = array_last (&p->stack);
+      p->state = PUSH_COLON;
+      return next_string (&top->key, &src, end);
+    }
+
+  if (!(json = json_new (JSON_STRING)))
+    return false;
+
+  if (!next_string (&json->data.string, &src, end))
+    {
+      json_free (json);
+      return false;
+    }
+
+  return push_value (p, json);
+}
+
+static bool
+push_start (json_parser_t *p, int token, const char **psrc, const char *end)
+{
+  const char *src = *psrc;
+  const char *stop;
+
+  p->token = token;
+  p->escape = false;
+
+  /* whole tokens are parsed in place, split ones are copied */
+  if (!(stop = token_scan (p, src + (token != TOKEN_SCALAR), end)))
+    {
+      *psrc = end;
+      mstr_clear (&p->pending);
+      return mstr_cat_byte (&p->pending, src, end - src);
+    }
+
+  *psrc = stop;
+  return push_token (p, src, stop);
+}
+
+static bool
+push_open (json_parser_t *p, int type)
+{
+  json_t *json;
+
+  if (!(json = json_new (type)))
+    return false;
+
+  if (!array_expand (&p->stack))
+    {
+      json_free (json);
+      return false;
+    }
+
+  push_frame_t *frame = array_push_back (&p->stack);
+  *frame = (push_frame_t) { .json = json, .key = MSTR_INIT };
+
+  p->state = type == JSON_ARRAY ? PUSH_VALUE_OR_END : PUSH_KEY_OR_END;
+  return true;
+}
+
+static bool
+push_close (json_parser_t *p, int type)
+{
+  push_frame_t *top = array_last (&p->stack);
+
+  if (!top || top->json->type != type)
+    return false;
+
+  p->stack.size--;
+  return push_value (p, top->json);
+}
+
+static bool
+push_step (json_parser_t *p, const char **psrc, const char *end)
+{
+  const char *src = *psrc;
+  push_frame_t *top;
+
+  *psrc = src + 1;
+
+  switch (p->state)
+    {
+    case PUSH_VALUE_OR_END:
+      if (*src == ']')
+	return push_close (p, JSON_ARRAY);
+      /* fall through */
+
+    case PUSH_VALUE:
+      switch (*src)
+	{
+	case '{':
+	  return push_open (p, JSON_OBJECT);
+
+	case '[':
+	  return push_open (p, JSON_ARRAY);
+
+	case '"':
+	  *psrc = src;
+	  return push_start (p, TOKEN_STRING, psrc, end);
+
+	case '-':
+	case '0' ... '9':
+	case 't':
+	case 'f':
+	case 'n':
+	  *psrc = src;
+	  return push_start (p, TOKEN_SCALAR, psrc, end);
+	}
+      return false;
+
+    case PUSH_KEY_OR_END:
+      if (*src == '}')
+	return push_close (p, JSON_OBJECT);
+      /* fall through */
+
+    case PUSH_KEY:
+      if (*src != '"')
+	return false;
+      *psrc = src;
+      return push_start (p, TOKEN_KEY, psrc, end);
+
+    case PUSH_COLON:
+      p->state = PUSH_VALUE;
+      return *src == ':';
+
+    case PUSH_NEXT:
+      top = array_last (&p->stack);
+
+      if (*src == ',')
+	{
+	  p->state = json_is_array (top->json) ? PUSH_VALUE : PUSH_KEY;
+	  return true;
+	}
+
+      if (*src == ']')
+	return push_close (p, JSON_ARRAY);
+
+      if (*src == '}')
+	return push_close (p, JSON_OBJECT);
+    }
+
+  return false;
+}
+
+static int
+worker_count (int nthreads)
+{
+  long online;
+
+  if (nthreads > 0)
+    return nthreads;
+
+  return (online = sysconf (_SC_NPROCESSORS_ONLN)) > 0 ? online : 1;
+}
+
+/* runs fn on up to nthreads threads but no more than there are tasks;
+   the caller is one of them, and threads that fail to start just leave
+   their share to the others */
+static void
+run_workers (void *(*fn) (void *), void *ctx, int nthreads, size_t tasks)
+{
+  pthread_t *threads = NULL;
+  int started = 0;
+
+  nthreads = worker_count (nthreads);
+  if ((size_t) nthreads > tasks)
+    nthreads = tasks;
+
+  if (nthreads > 1 && (threads = malloc ((nthreads - 1) * sizeof (pthread_t))))
+    for (; started < nthreads - 1; started++)
+      if (pthread_create (threads + started, NULL, fn, ctx))
+	break;
+
+  fn (ctx);
+
+  for (int i = 0; i < started; i++)
+    pthread_join (threads[i], NULL);
+
+  free (threads);
+}
+
+static bool
+lines_decode (lines_t *l, lines_chunk_t *chunk)
+{
+  structural_t index = STRUCTURAL_INIT;
+  parser_t p;
+  const char *end = chunk->end;
+  bool ret = true;
+
+  parser_init (&p, chunk->src, end - chunk->src, &chunk->arena);
+  p.flags = l->flags;
+  chunk->lines.element = sizeof (line_t);
+
+  for (const char *src = chunk->src, *eol; src < end; src = eol + 1)
+    {
+      if (!(eol = memchr (src, '\n', end - src)))
+	eol = end;
+
+      p.src = src;
+      p.end = eol;
+
+      /* blank lines are not reported */
+      skip_ws (&p);
+      if (p.src == p.end)
+	continue;
+
+      /* each line gets its own tape */
+      p.base = p.src;
+      p.tape = p.tape_end = NULL;
+
+      if ((l->flags & JSON_DECODE_FAST) && !parser_index (&p, &index))
+	{
+	  ret = false;
+	  break;
+	}
+
+      json_t *json = parse_root (&p);
+      skip_ws (&p);
+
+      /* a line holds exactly one value */
+      if (p.src != p.end)
+	json = NULL;
+
+      if (!array_expand (&chunk->lines))
+	{
+	  ret = false;
+	  break;
+	}
+
+      line_t *line = array_push_back (&chunk->lines);
+      *line = (line_t) { .json = json, .offset = src - l->buf };
+    }
+
+  parser_free (&p);
+  structural_free (&index);
+  return ret;
+}
+
+static void
+lines_flush (lines_t *l, lines_chunk_t *chunk)
+{
+  for (size_t i = 0; i < chunk->lines.size; i++)
+    {
+      line_t *line = (line_t *) chunk->lines.data + i;
+
+      if (__atomic_load_n (&l->failed, __ATOMIC_RELAXED))
+	break;
+
+      if (!l->cb (l->ctx, line->json, line->offset))
+	__atomic_store_n (&l->failed, true, __ATOMIC_RELAXED);
+    }
+
+  arena_free (&chunk->arena);
+  free (chunk->lines.data);
+  chunk->lines = ARRAY_INIT;
+}
+
+/* the next chunk that may be delivered, called under the lock */
+static lines_chunk_t *
+lines_ready (lines_t *l)
+{
+  lines_chunk_t *chunk;
+
+  if (l->flags & JSON_DECODE_ORDERED)
+    {
+      if (l->next >= l->count || !l->chunks[l->next].done)
+	return NULL;
+      return l->chunks + l->next++;
+    }
+
+  if ((chunk = l->ready))
+    l->ready = chunk->link;
+  return chunk;
+}
+
+static void *
+lines_worker (void *arg)
+{
+  lines_t *l = arg;
+  lines_chunk_t *chunk;
+
+  for (;;)
+    {
+      size_t i = __atomic_fetch_add (&l->claim, 1, __ATOMIC_RELAXED);
+
+      if (i >= l->count || __atomic_load_n (&l->failed, __ATOMIC_RELAXED))
+	return NULL;
+
+      chunk = l->chunks + i;
+      if (!lines_decode (l, chunk))
+	__atomic_store_n (&l->failed, true, __ATOMIC_RELAXED);
+
+      pthread_mutex_lock (&l->lock);
+
+      chunk->done = true;
+      if (!(l->flags & JSON_DECODE_ORDERED))
+	{
+	  chunk->link = l->ready;
+	  l->ready = chunk;
+	}
+
+      /* whoever delivers also drains the chunks finished meanwhile, the
+	 rest go back to decoding */
+      if (!l->delivering)
+	{
+	  l->delivering = true;
+
+	  while ((chunk = lines_ready (l)))
+	    {
+	      pthread_mutex_unlock (&l->lock);
+	      lines_flush (l, chunk);
+	      pthread_mutex_lock (&l->lock);
+	    }
+
+	  l->delivering = false;
+	}
+
+      pthread_mutex_unlock (&l->lock);
+    }
+}
+
+static bool
+split_decode (split_range_t *range)
+{
+  parser_t p;
+  json_t *json;
+
+  parser_init (&p, range->src, range->end - range->src, NULL);
+
+  for (;;)
+    {
+      skip_ws (&p);
+      if (!(json = parse (&p)))
+	goto err;
+
+      if (!array_expand (&p.stack))
+	{
+	  json_free (json);
+	  goto err;
+	}
+
+      *(json_t **) array_push_back (&p.stack) = json;
+
+      skip_ws (&p);
+      if (p.src == p.end)
+	break;
+
+      if (*p.src++ != ',')
+	goto err;
+    }
+
+  if (!parser_collect_array (&p, &range->items, 0))
+    goto err;
+
+  parser_free (&p);
+  return true;
+
+err:
+  for (size_t i = 0; i < p.stack.size; i++)
+    json_free (((json_t **) p.stack.data)[i]);
+  parser_free (&p);
+  return false;
+}
+
+static void *
+split_worker (void *arg)
+{
+  split_t *split = arg;
+
+  for (;;)
+    {
+      size_t i = __atomic_fetch_add (&split->claim, 1, __ATOMIC_RELAXED);
+
+      if (i >= split->count)
+	return NULL;
+
+      split->ranges[i].ok = split_decode (split->ranges + i);
+    }
+}
+
+static bool
+plan_task (plan_t *plan, const json_t *json, size_t from, size_t to,
+	   bool whole)
+{
+  if (!array_expand (&plan->parts))
+    return false;
+
+  plan_part_t *part = array_push_back (&plan->parts);
+  *part = (plan_part_t) {
+    .json = json,
+    .from = from,
+    .to = to,
+    .whole = whole,
+  };
+  return true;
+}
+
+static inline size_t
+plan_offset (plan_t *plan)
+{
+  return plan->e.pos - mstr_data (&plan->text);
+}
+
+static bool
+plan_text (plan_t *plan, size_t start)
+{
+  size_t end = plan_offset (plan);
+  plan_part_t *last = array_last (&plan->parts);
+
+  if (end == start)
+    return true;
+
+  /* adjacent text joins the previous span */
+  if (last && !last->json)
+    {
+      last->len += end - start;
+      return true;
+    }
+
+  if (!array_expand (&plan->parts))
+    return false;
+
+  plan_part_t *part = array_push_back (&plan->parts);
+  *part = (plan_part_t) { .text = start, .len = end - start };
+  return true;
+}
+
+static bool
+plan_node (plan_t *plan, const json_t *json, int depth)
+{
+  encoder_t *e = &plan->e;
+  bool array = json->type == JSON_ARRAY;
+  size_t start = plan_offset (plan);
+  size_t size;
+
+  if (array)
+    size = json->data.array.size;
+  else if (json->type == JSON_OBJECT)
+    size = json->data.object.size;
+  else
+    return stringify (e, json) && plan_text (plan, start);
+
+  /* a container too deep to lay out is encoded whole by one worker */
+  if (size < PLAN_SPLIT_MIN && depth >= PLAN_DESCEND_MAX)
+    return plan_task (plan, json, 0, size, true);
+
+  if (!emit_char (e, array ? '[' : '{'))
+    return false;
+
+  /* large containers are cut into ranges of items */
+  if (size >= PLAN_SPLIT_MIN)
+    {
+      size_t step = (size + plan->chunks - 1) / plan->chunks;
+
+      for (size_t from = 0; from < size; from += step)
+	{
+	  size_t to = size - from > step ? from + step : size;
+
+	  if (from && !emit_char (e, ','))
+	    return false;
+
+	  if (!plan_text (plan, start)
+	      || !plan_task (plan, json, from, to, false))
+	    return false;
+
+	  start = plan_offset (plan);
+	}
+    }
+  else
+    for (size_t i = 0; i < size; i++)
+      {
+	const json_t *child;
+
+	if (i && !emit_char (e, ','))
+	  return false;
+
+	if (array)
+	  child = *(json_t **) array_at (&json->data.array, i);
+	else
+	  {
+	    const json_pair_t *pair = json->data.object.pairs + i;
+
+	    if (!stringify_string (e, &pair->key) || !emit_char (e, ':'))
+	      return false;
+	    child = pair->value;
+	  }
+
+	if (!plan_text (plan, start) || !plan_node (plan, child, depth + 1))
+	  return false;
+
+	start = plan_offset (plan);
+      }
+
+  return emit_char (e, array ? ']' : '}') && plan_text (plan, start);
+}
+
+static bool
+plan_encode (plan_part_t *part)
+{
+  const json_t *json = part->json;
+  mstr_t *out = &part->out;
+
+  encoder_t e = {
+    .pos = mstr_data (out),
+    .end = mstr_data (out) + mstr_cap (out) - 1,
+    .ctx = out,
+    .flush = flush_mstr,
+  };
+
+  if (part->whole && !stringify (&e, json))
+    return false;
+
+  for (size_t i = part->from; !part->whole && i < part->to; i++)
+    {
+      const json_t *value;
+
+      if (i > part->from && !emit_char (&e, ','))
+	return false;
+
+      if (json->type == JSON_ARRAY)
+	value = *(json_t **) array_at (&json->data.array, i);
+      else
+	{
+	  const json_pair_t *pair = json->data.object.pairs + i;
+
+	  if (!stringify_string (&e, &pair->key) || !emit_char (&e, ':'))
+	    return false;
+	  value = pair->value;
+	}
+
+      if (!stringify (&e, value))
+	return false;
+    }
+
+  mstr_set_len (out, e.pos - mstr_data (out));
+  return true;
+}
+
+static void *
+plan_worker (void *arg)
+{
+  plan_t *plan = arg;
+
+  for (;;)
+    {
+      size_t i = __atomic_fetch_add (&plan->claim, 1, __ATOMIC_RELAXED);
+
+      if (i >= plan->parts.size)
+	return NULL;
+
+      plan_part_t *part = (plan_part_t *) plan->parts.data + i;
+
+      if (part->json)
+	part->ok = plan_encode (part);
+    }
+}
+
+static bool
+sax_string (sax_t *s, json_sax_string_t *cb)
+{
+  parser_t *p = &s->p;
+  const char *src = p->src;
+  const char *stop;
+
+  if (peek (p) != '"')
+    return false;
+
+  /* no escapes, hand out the input bytes */
+  if ((stop = scan_string (src + 1, p->end, false)) < p->end && *stop == '"')
+    {
+      p->src = stop + 1;
+      return !cb || cb (s->ctx, src + 1, stop - src - 1);
+    }
+
+  mstr_t *scratch = &p->scratch;
+  mstr_clear (scratch);
+
+  if (!next_string (scratch, &p->src, p->end))
+    return false;
+
+  return !cb || cb (s->ctx, mstr_data (scratch), mstr_len (scratch));
+}
+
+static bool
+sax_open (sax_t *s, int type)
+{
+  parser_t *p = &s->p;
+  array_t *frames = &p->frames;
+
+  if (p->max_depth && frames->size >= p->max_depth)
+    return false;
+
+  if (!array_expand (frames))
+    return false;
+  *(int *) array_push_back (frames) = type;
+
+  if (type == JSON_ARRAY ? !SAX_CALL (s, start_array)
+			 : !SAX_CALL (s, start_object))
+    return false;
+
+  p->src += 1;
+  skip_ws (p);
+  return true;
+}
+
+static bool
+sax_close (sax_t *s)
+{
+  parser_t *p = &s->p;
+  int type = *(int *) array_last (&p->frames);
+
+  p->frames.size--;
+  p->src += 1;
+
+  if (type == JSON_ARRAY)
+    return SAX_CALL (s, end_array);
+  return SAX_CALL (s, end_object);
+}
+
+static bool
+sax_parse (sax_t *s)
+{
+  parser_t *p = &s->p;
+  array_t *frames = &p->frames;
+  int type;
+
+  /* containers are entered on the frame stack instead of the call
+     stack, as in parse */
+value:
+  switch (peek (p))
+    {
+    case '[':
+      if (!sax_open (s, JSON_ARRAY))
+	return false;
+      if (peek (p) != ']')
+	goto value;
+      goto close;
+
+    case '{':
+      if (!sax_open (s, JSON_OBJECT))
+	return false;
+      if (peek (p) != '}')
+	goto key;
+      goto close;
+
+    default:
+      if (!sax_scalar (s))
+	return false;
+    }
+
+next:
+  if (!frames->size)
+    return true;
+
+  type = *(int *) array_last (frames);
+  skip_ws (p);
+
+  switch (peek (p))
+    {
+    case ',':
+      p->src += 1;
+      skip_ws (p);
+      if (type == JSON_ARRAY)
+	goto value;
+      goto key;
+
+    case ']':
+      if (type != JSON_ARRAY)
+	return false;
+      goto close;
+
+    case '}':
+      if (type != JSON_OBJECT)
+	return false;
+      goto close;
+
+    default:
+      return false;
+    }
+
+close:
+  if (!sax_close (s))
+    return false;
+  goto next;
+
+key:
+  if (!sax_string (s, s->h->key))
+    return false;
+
+  skip_ws (p);
+  if (peek (p) != ':')
+    return false;
+
+  p->src += 1;
+  skip_ws (p);
+  goto value;
+}
+
+static bool
+sax_scalar (sax_t *s)
+{
+  parser_t *p = &s->p;
+  const char *end;
+  char ch = peek (p);
+  number_t num;
+
+  switch (ch)
+    {
+    case '-':
+    case '0' ... '9':
+      if (!(end = number_parse (p->src, p->end, &num)))
+	return false;
+
+      p->src = end;
+
+      /* integers go through number when there is no integer callback */
+      if (num.type == NUMBER_INTEGER && s->h->integer)
+	return s->h->integer (s->ctx, num.integer);
+      if (num.type == NUMBER_UINT && s->h->uinteger)
+	return s->h->uinteger (s->ctx, num.uinteger);
+      if (num.type == NUMBER_INTEGER)
+	num.real = num.integer;
+      else if (num.type == NUMBER_UINT)
+	num.real = num.uinteger;
+
+      return SAX_CALL (s, number, num.real);
+
+    case '"':
+      return sax_string (s, s->h->string);
+
+    case 't':
+    case 'f':
+    case 'n':
+      if (!(end = skip_value (p->src, p->end)))
+	return false;
+
+      p->src = end;
+
+      if (ch == 'n')
+	return SAX_CALL (s, null);
+
+      return SAX_CALL (s, boolean, ch == 't');
+    }
+
+  return false;
+}
+
+static bool
+flush_mstr (encoder_t *e, size_t need)
+{
+  mstr_t *mstr = e->ctx;
+  size_t len = e->pos - mstr_data (mstr);
+
+  mstr_set_len (mstr, len);
+  if (!mstr_reserve (mstr, len + need + 1))
+    return false;
+
+  char *data = mstr_data (mstr);
+  e->pos = data + len;
+  e->end = data + mstr_cap (mstr) - 1;
+  return true;
+}
+
+static bool
+flush_none (encoder_t *e attr_unused, size_t need attr_unused)
+{
+  return false;
+}
+
+static bool
+flush_count (encoder_t *e, size_t need attr_unused)
+{
+  e->size += e->pos - e->start;
+  e->pos = e->start;
+  return true;
+}
+
+static bool
+flush_stream (encoder_t *e, size_t need attr_unused)
+{
+  stream_t *stream = e->ctx;
+  size_t len = e->pos - e->start;
+
+  e->pos = e->start;
+  return !len || stream->write (stream->ctx, e->start, len);
+}
+
+static bool
+write_fd (void *ctx, const char *data, size_t len)
+{
+  int fd = *(int *) ctx;
+
+  for (ssize_t ret; len; data += ret, len -= ret)
+    if ((ret = write (fd, data, len)) < 0)
+      {
+	if (errno != EINTR)
+	  return false;
+	ret = 0;
+      }
+
+  return true;
+}
+
+static bool
+write_file (void *ctx, const char *data, size_t len)
+{
+  return fwrite (data, 1, len, ctx) == len;
+}
+
+static bool
+emit_slow (encoder_t *e, const char *src, size_t n)
+{
+  for (size_t room; n; src += room, n -= room)
+    {
+      if (e->pos == e->end && !e->flush (e, n))
+	return false;
+
+      if ((room = e->end - e->pos) > n)
+	room = n;
+
+      memcpy (e->pos, src, room);
+      e->pos += room;
+    }
+
+  return true;
+}
+
+static inline bool
+emit (encoder_t *e, const void *src, size_t n)
+{
+  if (unlikely ((size_t) (e->end - e->pos) < n))
+    return emit_slow (e, src, n);
+
+  memcpy (e->pos, src, n);
+  e->pos += n;
+  return true;
+}
+
+static inline bool
+emit_char (encoder_t *e, char ch)
+{
+  if (unlikely (e->pos == e->end) && !e->flush (e, 1))
+    return false;
+
+  *e->pos++ = ch;
+  return true;
+}
+
+static inline char *
+emit_room (encoder_t *e, size_t n)
+{
+  /* n contiguous bytes at pos, or NULL if the sink cannot provide them */
+  if ((size_t) (e->end - e->pos) >= n)
+    return e->pos;
+
+  if (e->flush (e, n) && (size_t) (e->end - e->pos) >= n)
+    return e->pos;
+
+  return NULL;
+}
+
+static size_t
+utf8_decode (const char *src, const char *end, uint32_t *code)
+{
+  const unsigned char *s = (const unsigned char *) src;
+  size_t len = end - src;
+  uint32_t ch = s[0], min;
+  size_t n;
+
+  if (ch >= 0xF0 && ch <= 0xF4)
+    n = 4, ch &= 0x07, min = 0x10000;
+  else if (ch >= 0xE0 && ch <= 0xEF)
+    n = 3, ch &= 0x0F, min = 0x800;
+  else if (ch >= 0xC2 && ch <= 0xDF)
+    n = 2, ch &= 0x1F, min = 0x80;
+  else
+    goto err;
+
+  if (len < n)
+    goto err;
+
+  for (size_t i = 1; i < n; i++)
+    {
+      if ((s[i] & 0xC0) != 0x80)
+	goto err;
+      ch = ch << 6 | (s[i] & 0x3F);
+    }
+
+  if (ch < min || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+    goto err;
+
+  *code = ch;
+  return n;
+
+err:
+  /* replace one malformed byte at a time */
+  *code = 0xFFFD;
+  return 1;
+}
+
+static size_t
+escape_unicode (char *conv, uint32_t code)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t len = 0;
+
+  if (code > 0xFFFF)
+    {
+      code -= 0x10000;
+      len = escape_unicode (conv, 0xD800 | (code >> 10));
+      code = 0xDC00 | (code & 0x3FF);
+    }
+
+  conv += len;
+  conv[0] = '\\';
+  conv[1] = 'u';
+  conv[2] = hex[(code >> 12) & 0xF];
+  conv[3] = hex[(code >> 8) & 0xF];
+  conv[4] = hex[(code >> 4) & 0xF];
+  conv[5] = hex[code & 0xF];
+
+  return len + 6;
+}
+
+static bool
+stringify (encoder_t *e, const json_t *json)
+{
+  walk_frame_t *top;
+  bool ret = false;
+  walk_t w;
+
+  walk_init (&w);
+
+  for (;;)
+    {
+      switch (json->type)
+	{
+	case JSON_NULL:
+	case JSON_BOOL:
+	  if (!stringify_const (e, json))
+	    goto out;
+	  break;
+
+	case JSON_NUMBER:
+	case JSON_INTEGER:
+	case JSON_UINT:
+	  if (!stringify_number (e, json))
+	    goto out;
+	  break;
+
+	case JSON_STRING:
+	  if (!stringify_string (e, &json->data.string))
+	    goto out;
+	  break;
+
+	case JSON_ARRAY:
+	case JSON_OBJECT:
+	  if (!emit_char (e, json->type == JSON_ARRAY ? '[' : '{'))
+	    goto out;
+	  if (!walk_push (&w, json))
+	    goto out;
+	  break;
+
+	default:
+	  goto out;
+	}
+
+      /* climb out of finished containers up to the next item */
+      for (;;)
+	{
+	  if (!w.size)
+	    {
+	      ret = true;
+	      goto out;
+	    }
+
+	  top = w.frames + w.size - 1;
+	  const json_t *parent = top->json;
+	  size_t i = top->next;
+
+	  if (i < walk_size (parent))
+	    {
+	      if (i && !emit_char (e, ','))
+		goto out;
+
+	      if (parent->type == JSON_ARRAY)
+		json = *(json_t **) array_at (&parent->data.array, i);
+	      else
+		{
+		  const json_pair_t *pair = parent->data.object.pairs + i;
+
+		  if (!stringify_string (e, &pair->key)
+		      || !emit_char (e, ':'))
+		    goto out;
+		  json = pair->value;
+		}
+
+	      top->next++;
+	      break;
+	    }
+
+	  if (!emit_char (e, parent->type == JSON_ARRAY ? ']' : '}'))
+	    goto out;
+	  w.size--;
+	}
+    }
+
+out:
+  walk_free (&w);
+  return ret;
+}
+
+static bool
+stringify_const (encoder_t *e, const json_t *json)
+{
+  switch (json->type)
+    {
+    case JSON_NULL:
+      return emit (e, "null", 4);
+
+    case JSON_BOOL:
+      if (json->data.boolean)
+	return emit (e, "true", 4);
+      return emit (e, "false", 5);
+    }
+
+  return false;
+}
+
+static bool
+stringify_number (encoder_t *e, const json_t *json)
+{
+  char conv[NUMBER_REAL_LEN];
+  double num = json->data.number;
+  size_t len;
+
+  /* format in place when the sink has room, else via conv */
+  char *dest = emit_room (e, NUMBER_REAL_LEN);
+  char *buf = dest ? dest : conv;
+
+  if (json->type == JSON_INTEGER)
+    len = number_format_integer (buf, json->data.integer);
+  else if (json->type == JSON_UINT)
+    len = number_format_uint (buf, json->data.uinteger);
+  else if (isfinite (num))
+    len = number_format_real (buf, num);
+  else
+    /* nan and inf have no JSON spelling */
+    return emit (e, "null", 4);
+
+  if (!dest)
+    return emit (e, conv, len);
+
+  e->pos += len;
+  return true;
+}
+
+static bool
+stringify_string (encoder_t *e, const mstr_t *str)
+{
+  const char *src = mstr_data (str);
+  const char *end = src + mstr_len (str);
+  bool ascii = e->flags & JSON_ENCODE_ASCII;
+
+  if (!emit_char (e, '"'))
+    return false;
+
+  for (const char *run;;)
+    {
+      /* copy each run that needs no escaping with a single append */
+      src = scan_string ((run = src), end, ascii);
+      if (src != run && !emit (e, run, src - run))
+	return false;
+
+      if (src >= end)
+	break;
+
+      char conv[12];
+      size_t len = 2;
+      unsigned char ch = *src;
+
+      conv[0] = '\\';
+      if (ch >= 0x80)
+	{
+	  uint32_t code;
+	  src += utf8_decode (src, end, &code);
+	  len = escape_unicode (conv, code);
+	}
+      else if ((conv[1] = escape_table[ch]) == 'u')
+	{
+	  len = escape_unicode (conv, ch);
+	  src++;
+	}
+      else
+	src++;
+
+      if (!emit (e, conv, len))
+	return false;
+    }
+
+  if (!emit_char (e, '"'))
+    return false;
+
+  return true;
+}
+
+static bool
+json_init (json_t *json, int type)
+{
+  switch (json->type = type)
+    {
+    case JSON_NULL:
+      break;
+
+    case JSON_BOOL:
+      json->data.boolean = false;
+      break;
+
+    case JSON_ARRAY:
+      json->data.array = ARRAY_INIT;
+      json->data.array.element = sizeof (json_t *);
+      break;
+
+    case JSON_NUMBER:
+      json->data.number = 0;
+      break;
+
+    case JSON_INTEGER:
+      json->data.integer = 0;
+      break;
+
+    case JSON_UINT:
+      json->data.uinteger = 0;
+      break;
+
+    case JSON_STRING:
+      json->data.string = MSTR_INIT;
+      break;
+
+    case JSON_OBJECT:
+      json->data.object = (json_object_t) {};
+      break;
+
+    default:
+      return false;
+    }
+
+  return true;
+}
+
+static void
+walk_init (walk_t *w)
+{
+  w->frames = w->local;
+  w->size = 0;
+  w->cap = WALK_INLINE_LEN;
+}
+
+static bool
+walk_push (walk_t *w, const json_t *json)
+{
+  if (w->size == w->cap)
+    {
+      size_t cap = w->cap * 2;
+      walk_frame_t *frames;
+
+      if (w->frames == w->local)
+	{
+	  if (!(frames = malloc (cap * sizeof (walk_frame_t))))
+	    return false;
+	  memcpy (frames, w->local, sizeof (w->local));
+	}
+      else if (!(frames = realloc (w->frames, cap * sizeof (walk_frame_t))))
+	return false;
+
+      w->frames = frames;
+      w->cap = cap;
+    }
+
+  w->frames[w->size++] = (walk_frame_t) { .json = json };
+  return true;
+}
+
+static void
+walk_free (walk_t *w)
+{
+  if (w->frames != w->local)
+    free (w->frames);
+}
+
+static inline size_t
+walk_size (const json_t *json)
+{
+  return json->type == JSON_ARRAY ? json->data.array.size
+				  : json->data.object.size;
+}
+
+/* scalars and empty containers go at once, others wait on the stack */
+static void
+free_item (walk_t *w, json_t *json)
+{
+  if ((json->type != JSON_ARRAY && json->type != JSON_OBJECT)
+      || !walk_size (json))
+    json_release (json);
+  else if (!walk_push (w, json))
+    free_reversed (json);
+}
+
+/* the slot of the last item of a non-empty container */
+static inline json_t **
+free_last (json_t *json)
+{
+  if (json->type == JSON_ARRAY)
+    return (json_t **) json->data.array.data + json->data.array.size - 1;
+
+  return &json->data.object.pairs[json->data.object.size - 1].value;
+}
+
+static inline void
+free_drop (json_t *json)
+{
+  if (json->type == JSON_ARRAY)
+    json->data.array.size--;
+  else
+    mstr_free (&json->data.object.pairs[--json->data.object.size].key);
+}
+
+/* used when the stack cannot grow: items are freed from the last one
+   back, and on the way down the slot of the container entered holds its
+   parent instead, so the climb back needs no memory at all */
+static void
+free_reversed (json_t *json)
+{
+  json_t *parent = NULL;
+  json_t *child;
+
+  for (;;)
+    {
+      if (walk_size (json))
+	{
+	  json_t **slot = free_last (json);
+
+	  child = *slot;
+	  if ((child->type == JSON_ARRAY || child->type == JSON_OBJECT)
+	      && walk_size (child))
+	    {
+	      *slot = parent;
+	      parent = json;
+	      json = child;
+	      continue;
+	    }
+
+	  json_release (child);
+	  free_drop (json);
+	  continue;
+	}
+
+      json_release (json);
+
+      if (!(json = parent))
+	return;
+
+      parent = *free_last (json);
+      free_drop (json);
+    }
+}
+
+static void
+json_release (json_t *json)
+{
+  json_object_t *object;
+
+  /* the items are already gone */
+  switch (json->type)
+    {
+    case JSON_STRING:
+      mstr_free (&json->data.string);
+      break;
+
+    case JSON_ARRAY:
+      free (json->data.array.data);
+      break;
+
+    case JSON_OBJECT:
+      /* take may have moved the vector start past its allocation */
+      object = &json->data.object;
+      free (object->pairs - (object->index ? object->index->front : 0));
+      free (object->index);
+    }
+
+  free (json);
+}
+
+static bool
+array_expand (array_t *array)
+{
+  size_t cap = array->cap;
+  void *data = array->data;
+
+  if (array->size < cap)
+    return true;
+
+  if (!(cap = cap * ARRAY_EXPAN_RATIO))
+    cap = ARRAY_INIT_CAP;
+
+  if (!(data = realloc (data, cap * array->element)))
+    return false;
+
+  array->data = data;
+  array->cap = cap;
+  return true;
+}
+
+static bool
+object_expand (json_object_t *object)
+{
+  size_t cap;
+  json_pair_t *pairs;
+
+  object_compact (object);
+  cap = object->cap;
+  pairs = object->pairs;
+
+  if (!(cap = cap * OBJECT_EXPAN_RATIO))
+    cap = OBJECT_INIT_CAP;
+
+  if (cap > UINT32_MAX || !(pairs = realloc (pairs, cap * sizeof (*pairs))))
+    return false;
+
+  object->pairs = pairs;
+  object->cap = cap;
+
+  /* the index is sized for the capacity, so it grows with it */
+  if (!object_reindex (object, NULL))
+    {
+      object->cap = object->size;
+      return false;
+    }
+
+  return true;
+}
+
+static inline uint64_t
+hash_mix (uint64_t a, uint64_t b)
+{
+  unsigned __int128 r = (unsigned __int128) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static uint64_t
+hash_key (const char *key, size_t len)
+{
+  uint64_t hash = HASH_SEED ^ len;
+  uint64_t word;
+
+  for (; len >= 8; key += 8, len -= 8)
+    {
+      memcpy (&word, key, 8);
+      hash = hash_mix (hash ^ word, HASH_MUL);
+    }
+
+  if (len)
+    {
+      word = 0;
+      memcpy (&word, key, len);
+      hash = hash_mix (hash ^ word, HASH_MUL);
+    }
+
+  return hash_mix (hash, HASH_SEED);
+}
+
+static inline uint32_t
+group_match (const uint8_t *ctrl, uint8_t tag)
+{
+#ifdef __SSE2__
+  __m128i group = _mm_loadu_si128 ((const __m128i *) ctrl);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (group, _mm_set1_epi8 (tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < INDEX_GROUP; i++)
+    mask |= (uint32_t) (ctrl[i] == tag) << i;
+  return mask;
+#endif
+}
+
+static void
+key_probe (json_key_t *key, const char *data, size_t len)
+{
+  size_t head = len < 7 ? len : 7;
+
+  *key = (json_key_t) { .data = data, .len = len };
+
+  /* inline keys are matched on their length byte and up to 7 leading
+     bytes with one word compare before the tail is looked at */
+  if (len <= MSTR_SSO_CAP)
+    {
+      mstr_sso_t img = { .flg = MSTR_FLG_SSO, .len = len };
+      memcpy (img.data, data, head);
+      memcpy (&key->prefix, &img, sizeof (key->prefix));
+      memset (&key->mask, 0xff, head + 1);
+    }
+}
+
+static json_pair_t *
+pairs_scan (json_pair_t *pairs, size_t size, const json_key_t *key)
+{
+  size_t len = key->len;
+  size_t head = len < 7 ? len : 7;
+  const char *tail = key->data + head;
+  uint64_t word;
+
+  for (size_t i = 0; i < size; i++)
+    {
+      const mstr_t *str = &pairs[i].key;
+
+      if (mstr_is_sso (str))
+	{
+	  memcpy (&word, str, sizeof (word));
+	  if (key->mask && (word & key->mask) == key->prefix
+	      && memcmp (str->sso.data + head, tail, len - head) == 0)
+	    return pairs + i;
+	}
+      else if (str->heap.len == len
+	       && memcmp (str->heap.data, key->data, len) == 0)
+	return pairs + i;
+    }
+
+  return NULL;
+}
+
+static json_pair_t *
+index_find (const json_object_t *object, const char *key, size_t len,
+	    uint64_t hash)
+{
+  const json_index_t *index = object->index;
+  size_t mask = index->mask;
+  size_t pos = (hash >> 7) & mask;
+  uint8_t tag = hash & 0x7F;
+
+  for (size_t step = 0;; pos = (pos + (step += INDEX_GROUP)) & mask)
+    {
+      const uint8_t *ctrl = index->ctrl + pos;
+
+      for (uint32_t match = group_match (ctrl, tag); match; match &= match - 1)
+	{
+	  size_t slot = (pos + __builtin_ctz (match)) & mask;
+	  json_pair_t *pair
+	      = object->pairs + (uint32_t) (index->slots[slot] - index->base);
+
+	  const mstr_t *str = &pair->key;
+	  const char *data = mstr_data (str);
+
+	  if (mstr_len (str) == len && memcmp (data, key, len) == 0)
+	    return pair;
+	}
+
+      if (group_match (ctrl, INDEX_EMPTY))
+	return NULL;
+    }
+}
+
+static json_pair_t *
+object_find (const json_object_t *object, const char *key, size_t len)
+{
+  if (!object->index)
+    {
+      json_key_t probe;
+      key_probe (&probe, key, len);
+      return pairs_scan (object->pairs, object->size, &probe);
+    }
+
+  return index_find (object, key, len, hash_key (key, len));
+}
+
+static void
+index_insert (json_index_t *index, uint64_t hash, uint32_t at)
+{
+  size_t mask = index->mask;
+  size_t pos = (hash >> 7) & mask;
+  uint8_t tag = hash & 0x7F;
+
+  for (size_t step = 0;; pos = (pos + (step += INDEX_GROUP)) & mask)
+    {
+      uint32_t empty = group_match (index->ctrl + pos, INDEX_EMPTY);
+
+      if (!empty)
+	continue;
+
+      size_t slot = (pos + __builtin_ctz (empty)) & mask;
+      index->ctrl[slot] = tag;
+      index->slots[slot] = at + index->base;
+
+      /* the first group is mirrored past the end for unaligned loads */
+      if (slot < INDEX_GROUP)
+	index->ctrl[mask + 1 + slot] = tag;
+      return;
+    }
+}
+
+static uint32_t *
+index_locate (json_index_t *index, uint64_t hash, uint32_t at)
+{
+  size_t mask = index->mask;
+  size_t pos = (hash >> 7) & mask;
+  uint8_t tag = hash & 0x7F;
+
+  for (size_t step = 0;; pos = (pos + (step += INDEX_GROUP)) & mask)
+    {
+      const uint8_t *ctrl = index->ctrl + pos;
+
+      for (uint32_t match = group_match (ctrl, tag); match; match &= match - 1)
+	{
+	  size_t slot = (pos + __builtin_ctz (match)) & mask;
+
+	  if (index->slots[slot] == at + index->base)
+	    return index->slots + slot;
+	}
+
+      if (group_match (ctrl, INDEX_EMPTY))
+	return NULL;
+    }
+}
+
+static void
+index_erase (json_index_t *index, uint64_t hash, uint32_t at)
+{
+  uint32_t *found;
+  size_t mask = index->mask;
+
+  if (!(found = index_locate (index, hash, at)))
+    return;
+
+  size_t slot = found - index->slots;
+  index->ctrl[slot] = INDEX_DELETED;
+
+  if (slot < INDEX_GROUP)
+    index->ctrl[mask + 1 + slot] = INDEX_DELETED;
+  index->deleted++;
+}
+
+static void
+index_move (json_index_t *index, const mstr_t *key, uint32_t from,
+	    uint32_t to)
+{
+  uint64_t hash = hash_key (mstr_data (key), mstr_len (key));
+  uint32_t *found;
+
+  if ((found = index_locate (index, hash, from)))
+    *found = to + index->base;
+}
+
+static void
+object_compact (json_object_t *object)
+{
+  json_index_t *index = object->index;
+
+  /* move the pairs back to the start of their allocation */
+  if (!index || !index->front)
+    return;
+
+  json_pair_t *start = object->pairs - index->front;
+  memmove (start, object->pairs, object->size * sizeof (json_pair_t));
+
+  object->pairs = start;
+  object->cap += index->front;
+  index->front = 0;
+}
+
+static bool
+object_reindex (json_object_t *object, arena_t *arena)
+{
+  size_t cap = INDEX_MIN_CAP;
+  json_index_t *index, *old;
+
+  object_compact (object);
+  old = object->index;
+
+  /* small objects are scanned linearly and carry no index */
+  if (object->cap <= OBJECT_SMALL_MAX)
+    {
+      for (uint32_t i = 1; i < object->size; i++)
+	{
+	  const mstr_t *str = &object->pairs[i].key;
+	  json_key_t probe;
+
+	  key_probe (&probe, mstr_data (str), mstr_len (str));
+	  if (pairs_scan (object->pairs, i, &probe))
+	    return false;
+	}
+
+      if (!arena)
+	free (old);
+      object->index = NULL;
+      return true;
+    }
+
+  /* keep the load factor at or below 7/8 */
+  for (; cap / 8 * 7 < object->cap;)
+    cap <<= 1;
+
+  size_t ctrl = (cap + INDEX_GROUP + 3) & ~(size_t) 3;
+  size_t size = sizeof (json_index_t) + ctrl + cap * sizeof (uint32_t);
+
+  if (!(index = arena ? arena_alloc (arena, size) : malloc (size)))
+    return false;
+
+  index->mask = cap - 1;
+  index->deleted = 0;
+  index->base = 0;
+  index->front = 0;
+  index->slots = (uint32_t *) (index->ctrl + ctrl);
+  memset (index->ctrl, INDEX_EMPTY, cap + INDEX_GROUP);
+  object->index = index;
+
+  for (uint32_t i = 0; i < object->size; i++)
+    {
+      const mstr_t *str = &object->pairs[i].key;
+      const char *key = mstr_data (str);
+      size_t len = mstr_len (str);
+      uint64_t hash = hash_key (key, len);
+
+      if (unlikely (index_find (object, key, len, hash)))
+	{
+	  object->index = old;
+	  if (!arena)
+	    free (index);
+	  return false;
+	}
+
+      index_insert (index, hash, i);
+    }
+
+  if (!arena)
+    free (old);
+  return true;
+}
+
+static bool
+next_hex4 (const char *src, uint32_t *pcode)
+{
+  uint32_t code = 0;
+
+  for (int i = 0; i < 4; i++)
+    {
+      char ch;
+      code <<= 4;
+      switch (ch = src[i])
+	{
+	case '0' ... '9':
+	  code += ch - '0';
+	  break;
+
+	case 'a' ... 'f':
+	  code += ch + 10 - 'a';
+	  break;
+
+	case 'A' ... 'F':
+	  code += ch + 10 - 'A';
+	  break;
+
+	default:
+	  return false;
+	}
+    }
+
+  *pcode = code;
+  return true;
+}
+
+static bool
+next_unicode (mstr_t *mstr, const char **psrc, const char *end)
+{
+  const char *src = *psrc;
+  uint32_t code, low;
+  char result[4];
+  size_t len;
+
+  if (end - src < 4 || !next_hex4 (src, &code))
+    return false;
+  src += 4;
+
+  /* a high surrogate pairs up with an immediately following low one */
+  if (code >= 0xD800 && code <= 0xDBFF && end - src >= 6 && src[0] == '\\'
+      && src[1] == 'u' && next_hex4 (src + 2, &low) && low >= 0xDC00
+      && low <= 0xDFFF)
+    {
+      code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+      src += 6;
+    }
+
+  if (code <= 0x7F)
+    {
+      result[0] = code;
+      len = 1;
+    }
+  else if (code <= 0x7FF)
+    {
+      result[0] = 0xC0 | (code >> 6);
+      result[1] = 0x80 | (code & 0x3F);
+      len = 2;
+    }
+  else if (code <= 0xFFFF)
+    {
+      result[0] = 0xE0 | (code >> 12);
+      result[1] = 0x80 | ((code >> 6) & 0x3F);
+      result[2] = 0x80 | (code & 0x3F);
+      len = 3;
+    }
+  else
+    {
+      result[0] = 0xF0 | (code >> 18);
+      result[1] = 0x80 | ((code >> 12) & 0x3F);
+      result[2] = 0x80 | ((code >> 6) & 0x3F);
+      result[3] = 0x80 | (code & 0x3F);
+      len = 4;
+    }
+
+  if (!mstr_cat_byte (mstr, result, len))
+    return false;
+
+  *psrc = src;
+  return true;
+}
+
+static inline const char *
+scan_string (const char *src, const char *end, bool ascii)
+{
+  /* stop at the first '"', '\\' or control character, and at the first
+     non-ASCII byte if asked to */
+#ifdef __AVX2__
+  const __m256i quote32 = _mm256_set1_epi8 ('"');
+  const __m256i slash32 = _mm256_set1_epi8 ('\\');
+  const __m256i ctrl32 = _mm256_set1_epi8 (0x1f);
+
+  for (; end - src >= 32; src += 32)
+    {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *) src);
+      __m256i hit = _mm256_or_si256 (
+	  _mm256_or_si256 (_mm256_cmpeq_epi8 (v, quote32),
+			   _mm256_cmpeq_epi8 (v, slash32)),
+	  _mm256_cmpeq_epi8 (_mm256_min_epu8 (v, ctrl32), v));
+      uint32_t mask = _mm256_movemask_epi8 (hit);
+
+      if (ascii)
+	mask |= _mm256_movemask_epi8 (v);
+
+      if (mask)
+	return src + __builtin_ctz (mask);
+    }
+#endif
+
+#ifdef __SSE2__
+  const __m128i quote16 = _mm_set1_epi8 ('"');
+  const __m128i slash16 = _mm_set1_epi8 ('\\');
+  const __m128i ctrl16 = _mm_set1_epi8 (0x1f);
+
+  for (; end - src >= 16; src += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i hit = _mm_or_si128 (
+	  _mm_or_si128 (_mm_cmpeq_epi8 (v, quote16),
+			_mm_cmpeq_epi8 (v, slash16)),
+	  _mm_cmpeq_epi8 (_mm_min_epu8 (v, ctrl16), v));
+      uint32_t mask = _mm_movemask_epi8 (hit);
+
+      if (ascii)
+	mask |= _mm_movemask_epi8 (v);
+
+      if (mask)
+	return src + __builtin_ctz (mask);
+    }
+#endif
+
+  for (unsigned char ch; src < end; src++)
+    if ((ch = *src) == '"' || ch == '\\' || ch < 0x20
+	|| (ascii && ch >= 0x80))
+      break;
+
+  return src;
+}
+
+static bool
+next_string (mstr_t *mstr, const char **psrc, const char *end)
+{
+  if (*psrc >= end || **psrc != '"')
+    return false;
+
+  const char *src = *psrc + 1;
+
+  for (const char *run;;)
+    {
+      /* copy each escape-free run with a single append */
+      src = scan_string ((run = src), end, false);
+      if (src != run && !mstr_cat_byte (mstr, run, src - run))
+	goto err;
+
+      if (src >= end)
+	goto err;
+
+      switch (*src++)
+	{
+	case '"':
+	  *psrc = src;
+	  return true;
+
+	case '\\':
+	  break;
+
+	default:
+	  goto err;
+	}
+
+      char ch;
+      switch (ch = src < end ? *src++ : '\0')
+	{
+	case '/':
+	case '"':
+	case '\\':
+	  break;
+
+	case 'b':
+	  ch = '\b';
+	  break;
+
+	case 'f':
+	  ch = '\f';
+	  break;
+
+	case 'n':
+	  ch = '\n';
+	  break;
+
+	case 'r':
+	  ch = '\r';
+	  break;
+
+	case 't':
+	  ch = '\t';
+	  break;
+
+	case 'u':
+	  if (!next_unicode (mstr, &src, end))
+	    goto err;
+	  continue;
 
-  if (src == end)
-    goto err;
+	default:
+	  goto err;
+	}
 
-  *psrc = end;
-  return ret;
+      if (!mstr_cat_char (mstr, ch))
+	goto err;
+    }
 
 err:
-  free (ret);
-  return NULL;
+  mstr_free (mstr);
+  return false;
 }
 
-static json_t *
-parse_string (const char **psrc)
+static inline const char *
+skip_space (const char *src, const char *end)
 {
-  json_t *ret = JSON_NEW (JSON_STRING);
-  mstr_t *mstr = &ret->data.string;
-
-  if (!next_string (mstr, psrc))
-    goto err;
-  return ret;
+  if (src >= end || !is_ws[(unsigned char) *src])
+    return src;
 
-err:
-  free (ret);
-  return NULL;
+  return scan_ws (src + 1, end);
 }
 
-static json_t *
-parse_object (const char **psrc)
+static inline const char *
+scan_nested (const char *src, const char *end)
 {
-  json_t *ret = JSON_NEW (JSON_OBJECT);
-  rbtree_t *tree = &ret->data.object;
-
-  *psrc += 1;
-  skip_ws (psrc);
-  if (**psrc == '}')
+  /* stop at the first quote or bracket; '[' and ']' differ from '{' and
+     '}' only in bit 5 */
+#ifdef __SSE2__
+  for (; end - src >= 16; src += 16)
     {
-      *psrc += 1;
-      return ret;
+      __m128i v = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+      __m128i hit = _mm_or_si128 (
+	  _mm_or_si128 (_mm_cmpeq_epi8 (lower, _mm_set1_epi8 ('{')),
+			_mm_cmpeq_epi8 (lower, _mm_set1_epi8 ('}'))),
+	  _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')));
+      uint32_t mask = _mm_movemask_epi8 (hit);
+
+      if (mask)
+	return src + __builtin_ctz (mask);
     }
+#endif
 
-  json_pair_t *pair;
-
-  for (;;)
-    {
-      if (!(pair = malloc (sizeof (json_pair_t))))
-	goto err;
-
-      pair->key = MSTR_INIT;
-      if (!next_string (&pair->key, psrc))
-	goto err2;
-
-      skip_ws (psrc);
-
-      if (**psrc != ':')
-	goto err3;
-      *psrc += 1;
-
-      skip_ws (psrc);
-
-      if (!(pair->value = parse (psrc)))
-	goto err3;
+  for (unsigned char ch; src < end; src++)
+    if ((ch = *src | 0x20) == '{' || ch == '}' || *src == '"')
+      break;
 
-      if (!json_object_add (ret, pair))
-	goto err4;
+  return src;
+}
 
-      skip_ws (psrc);
+static const char *
+skip_string (const char *src, const char *end)
+{
+  for (src++;;)
+    {
+      if ((src = scan_string (src, end, false)) >= end)
+	return NULL;
 
-      switch (**psrc)
+      switch (*src)
 	{
-	case ',':
-	  *psrc += 1;
-	  skip_ws (psrc);
-	  break;
+	case '"':
+	  return src + 1;
 
-	case '}':
-	  *psrc += 1;
-	  return ret;
+	case '\\':
+	  src += 2;
+	  break;
 
 	default:
-	  goto err;
+	  return NULL;
 	}
     }
+}
 
-err4:
-  json_free (pair->value);
+static const char *
+skip_nested (const char *src, const char *end)
+{
+  /* skipped containers are only checked for balance */
+  for (size_t depth = 0; (src = scan_nested (src, end)) < end;)
+    switch (*src)
+      {
+      case '"':
+	if (!(src = skip_string (src, end)))
+	  return NULL;
+	break;
 
-err3:
-  mstr_free (&pair->key);
+      case '{':
+      case '[':
+	depth++;
+	src++;
+	break;
 
-err2:
-  free (pair);
+      default:
+	src++;
+	if (--depth == 0)
+	  return src;
+	break;
+      }
 
-err:
-  object_free (tree);
-  free ((void *) ret);
   return NULL;
 }
 
-#undef JSON_NEW
-
-static bool
-stringify (mstr_t *mstr, const json_t *json)
+static const char *
+skip_value (const char *src, const char *end)
 {
-  switch (json->type)
+  size_t len = end - src;
+  number_t num;
+
+  if (src >= end)
+    return NULL;
+
+  switch (*src)
     {
-    case JSON_NULL:
-    case JSON_BOOL:
-      return stringify_const (mstr, json);
+    case '"':
+      return skip_string (src, end);
 
-    case JSON_ARRAY:
-      return stringify_array (mstr, json);
+    case '{':
+    case '[':
+      return skip_nested (src, end);
 
-    case JSON_NUMBER:
-      return stringify_number (mstr, json);
+    case '-':
+    case '0' ... '9':
+      return number_parse (src, end, &num);
 
-    case JSON_STRING:
-      return stringify_string (mstr, json);
+    case 't':
+      return len >= 4 && memcmp (src, "true", 4) == 0 ? src + 4 : NULL;
 
-    case JSON_OBJECT:
-      return stringify_object (mstr, json);
+    case 'f':
+      return len >= 5 && memcmp (src, "false", 5) == 0 ? src + 5 : NULL;
+
+    case 'n':
+      return len >= 4 && memcmp (src, "null", 4) == 0 ? src + 4 : NULL;
     }
 
-  return false;
+  return NULL;
 }
 
-static bool
-stringify_const (mstr_t *mstr, const json_t *json)
+static const char *
+key_span (const char *src, const char *end, mstr_t *scratch,
+	  const char **key, size_t *len)
 {
-  switch (json->type)
-    {
-    case JSON_NULL:
-      return mstr_cat_cstr (mstr, "null");
+  const char *stop;
 
-    case JSON_BOOL:
-      return mstr_cat_cstr (mstr, json->data.boolean ? "true" : "false");
+  if (src >= end || *src != '"')
+    return NULL;
+
+  /* plain keys are handed out in place, others unescaped into scratch */
+  if ((stop = scan_string (src + 1, end, false)) < end && *stop == '"')
+    {
+      *key = src + 1;
+      *len = stop - src - 1;
+      return stop + 1;
     }
 
-  return false;
+  mstr_clear (scratch);
+  if (!next_string (scratch, &src, end))
+    return NULL;
+
+  *key = mstr_data (scratch);
+  *len = mstr_len (scratch);
+  return src;
+}
+
+static const char *
+cursor_key (const char *src, const char *end, const char *key, size_t len,
+	    bool *hit)
+{
+  mstr_t name = MSTR_INIT;
+  const char *data;
+  size_t n;
+
+  if ((src = key_span (src, end, &name, &data, &n)))
+    *hit = n == len && memcmp (data, key, len) == 0;
+
+  mstr_free (&name);
+  return src;
 }
 
 static bool
-stringify_array (mstr_t *mstr, const json_t *json)
+pointer_token (mstr_t *out, const char *src, size_t len)
 {
-  const array_t *array = &json->data.array;
+  const char *end = src + len;
 
-  if (!mstr_cat_char (mstr, '['))
-    return false;
+  mstr_clear (out);
 
-  for (size_t i = 0; i < array->size; i++)
+  for (; src < end; src++)
     {
-      json_t *elem = *(json_t **) array_at (array, i);
+      char ch = *src;
 
-      if (i && !mstr_cat_char (mstr, ','))
-	return false;
+      /* ~0 stands for ~ and ~1 for /, any other ~ is malformed */
+      if (ch == '~')
+	{
+	  if (++src >= end || (*src != '0' && *src != '1'))
+	    return false;
+	  ch = *src == '0' ? '~' : '/';
+	}
 
-      if (!stringify (mstr, elem))
+      if (!mstr_cat_char (out, ch))
 	return false;
     }
 
-  if (!mstr_cat_char (mstr, ']'))
-    return false;
-
   return true;
 }
 
 static bool
-stringify_number (mstr_t *mstr, const json_t *json)
+pointer_index (const char *token, size_t len, size_t *index)
 {
-  char conv[16] = {};
-  double num = json->data.number;
-
-  if (snprintf (conv, 16, "%lf", num) <= 0)
+  /* array indices are decimal without leading zeros, "-" never exists */
+  if (!len || len > 19 || (len > 1 && *token == '0'))
     return false;
 
-  if (!mstr_cat_cstr (mstr, conv))
-    return false;
+  *index = 0;
+  for (size_t i = 0; i < len; i++)
+    {
+      if (token[i] < '0' || token[i] > '9')
+	return false;
+      *index = *index * 10 + (token[i] - '0');
+    }
 
   return true;
 }
 
 static bool
-stringify_string (mstr_t *mstr, const json_t *json)
+pointer_step (json_cursor_t *cur, const char *token, size_t len)
 {
-  const mstr_t *src = &json->data.string;
-  const char *str = mstr_data (src);
-  size_t len = mstr_len (src);
-
-  if (!mstr_cat_char (mstr, '"'))
-    return false;
-
-  for (size_t i = 0; i < len; i++)
-    {
-      char ch = str[i];
-      switch (ch)
-	{
-	case '"':
-	  if (!mstr_cat_cstr (mstr, "\\\""))
-	    return false;
-	  break;
+  size_t index;
 
-	default:
-	  if (!mstr_cat_char (mstr, ch))
-	    return false;
-	  break;
-	}
-    }
+  if (cur->src < cur->end && *cur->src == '{')
+    return json_cursor_field_n (cur, token, len, cur);
 
-  if (!mstr_cat_char (mstr, '"'))
+  if (!pointer_index (token, len, &index))
     return false;
 
-  return true;
+  return json_cursor_index (cur, index, cur);
 }
 
 static bool
-stringify_object (mstr_t *mstr, const json_t *json)
+query_segment (const char **pexpr, mstr_t *key, size_t *index, int *kind)
 {
-  const rbtree_t *tree = &json->data.object;
-
-  if (!mstr_cat_char (mstr, '{'))
-    return false;
-
-  if (!tree->size)
-    goto end;
+  const char *expr = *pexpr;
+  size_t n;
 
-  rbtree_node_t **stack
-      = alloca (OBJECT_MAX_HEIGHT * sizeof (rbtree_node_t *));
-  size_t stack_size = 1;
-  stack[0] = tree->root;
+  mstr_clear (key);
 
-  for (size_t i = 0; stack_size; i++)
+  if (*expr == '[' && (expr[1] == '\'' || expr[1] == '"'))
     {
-      rbtree_node_t *node = stack[stack_size - 1];
-      json_pair_t *pair = container_of (node, json_pair_t, node);
-      rbtree_node_t *right = node->right, *left = node->left;
-      json_t key = { .data.string = pair->key };
+      char quote = expr[1];
 
-      stack_size--;
+      /* a quoted name, backslash keeps the next byte as is */
+      for (expr += 2; *expr != quote; expr++)
+	{
+	  if (*expr == '\\' && expr[1])
+	    expr++;
 
-      if (i && !mstr_cat_char (mstr, ','))
-	return false;
+	  if (!*expr || !mstr_cat_char (key, *expr))
+	    return false;
+	}
 
-      if (!stringify_string (mstr, &key))
+      if (expr[1] != ']')
 	return false;
 
-      if (!mstr_cat_char (mstr, ':'))
-	return false;
+      *kind = QUERY_KEY;
+      *pexpr = expr + 2;
+      return true;
+    }
 
-      if (!stringify (mstr, pair->value))
+  if (*expr == '[')
+    {
+      n = strcspn (++expr, "]");
+      if (expr[n] != ']' || !pointer_index (expr, n, index))
 	return false;
 
-      if (right)
-	stack[stack_size++] = right;
-
-      if (left)
-	stack[stack_size++] = left;
+      *kind = QUERY_INDEX;
+      *pexpr = expr + n + 1;
+      return true;
     }
 
-end:
-  if (!mstr_cat_char (mstr, '}'))
-    return false;
-  return true;
-}
-
-static void
-array_free (array_t *array)
-{
-  size_t size = array->size;
-  json_t **data = array->data;
+  if (*expr == '.')
+    expr++;
 
-  for (size_t i = 0; i < size; i++)
-    json_free (data[i]);
+  if (!(n = strcspn (expr, ".[")) || !mstr_assign_byte (key, expr, n))
+    return false;
 
-  free (data);
+  *kind = QUERY_KEY;
+  *pexpr = expr + n;
+  return true;
 }
 
-static void
-object_free (rbtree_t *tree)
+static bool
+query_child (json_query_t *q, uint32_t *at, mstr_t *key, size_t index,
+	     int kind)
 {
-  if (!tree->size)
-    return;
+  query_node_t *node = (query_node_t *) q->nodes.data + *at;
+  query_edge_t *edge;
 
-  rbtree_node_t **stack
-      = alloca (OBJECT_MAX_HEIGHT * sizeof (rbtree_node_t *));
-  size_t stack_size = 1;
-  stack[0] = tree->root;
-
-  for (; stack_size;)
+  for (size_t i = 0; i < node->edges.size; i++)
     {
-      rbtree_node_t *node = stack[stack_size - 1];
-      json_pair_t *pair = container_of (node, json_pair_t, node);
-      rbtree_node_t *left = node->left, *right = node->right;
-
-      stack_size--;
+      edge = (query_edge_t *) node->edges.data + i;
 
-      json_free (pair->value);
-      mstr_free (&pair->key);
-      free (pair);
-
-      if (right)
-	stack[stack_size++] = right;
-
-      if (left)
-	stack[stack_size++] = left;
+      if (edge->kind == kind
+	  && (!(kind & QUERY_KEY) || mstr_cmp_mstr (&edge->key, key) == 0)
+	  && (!(kind & QUERY_INDEX) || edge->index == index))
+	{
+	  *at = edge->node;
+	  return true;
+	}
     }
-}
 
-static bool
-array_expand (array_t *array)
-{
-  size_t cap = array->cap;
-  void *data = array->data;
+  if (q->nodes.size >= QUERY_NONE || !array_expand (&q->nodes))
+    return false;
 
-  if (array->size < cap)
-    return true;
+  /* the expansion may have moved the parent */
+  node = (query_node_t *) q->nodes.data + *at;
+  if (!array_expand (&node->edges))
+    return false;
 
-  if (!(cap = cap * ARRAY_EXPAN_RATIO))
-    cap = ARRAY_INIT_CAP;
+  uint32_t child = q->nodes.size;
+  query_node_t *new = array_push_back (&q->nodes);
+  *new = (query_node_t) { .first = QUERY_NONE };
+  new->edges.element = sizeof (query_edge_t);
 
-  if (!(data = realloc (data, cap * array->element)))
-    return false;
+  edge = array_push_back (&node->edges);
+  *edge = (query_edge_t) { .key = *key, .index = index, .kind = kind };
+  edge->node = child;
 
-  array->data = data;
-  array->cap = cap;
+  *key = MSTR_INIT;
+  *at = child;
   return true;
 }
 
 static bool
-next_unicode (mstr_t *mstr, const char *src)
+query_add (json_query_t *q, const char *expr, uint32_t id)
 {
-  uint32_t code = 0;
-  char result[5] = {};
+  mstr_t key = MSTR_INIT;
+  bool ret = false;
+  uint32_t at = 0;
+  size_t index = 0;
+  int kind;
+
+  if (!*expr || *expr == '/')
+    /* a JSON pointer, see json_extract */
+    while (*expr == '/')
+      {
+	const char *token = ++expr;
+	size_t n = strcspn (token, "/");
 
-  for (int i = 0; i < 4; i++)
-    {
-      char ch;
-      code <<= 4;
-      switch (ch = src[i])
-	{
-	case '0' ... '9':
-	  code += ch - '0';
-	  break;
+	expr += n;
+	kind = QUERY_KEY;
 
-	case 'a' ... 'f':
-	  code += ch + 10 - 'a';
-	  break;
+	if (pointer_index (token, n, &index))
+	  kind |= QUERY_INDEX;
 
-	case 'A' ... 'F':
-	  code += ch + 10 - 'A';
-	  break;
+	if (!pointer_token (&key, token, n)
+	    || !query_child (q, &at, &key, index, kind))
+	  goto err;
+      }
+  else
+    {
+      if (*expr == '$')
+	expr++;
 
-	default:
-	  return false;
-	}
+      while (*expr)
+	if (!query_segment (&expr, &key, &index, &kind)
+	    || !query_child (q, &at, &key, index, kind))
+	  goto err;
     }
 
-  if (code <= 0x7F)
-    result[0] = code;
-  else if (code <= 0x7FF)
-    {
-      result[0] = 0xC0 | (code >> 6);
-      result[1] = 0x80 | (code & 0x3F);
-    }
-  else if (code <= 0xFFFF)
-    {
-      result[0] = 0xE0 | (code >> 12);
-      result[1] = 0x80 | ((code >> 6) & 0x3F);
-      result[2] = 0x80 | (code & 0x3F);
-    }
-  else if (code <= 0x10FFFF)
-    {
-      result[0] = 0xF0 | (code >> 18);
-      result[1] = 0x80 | ((code >> 12) & 0x3F);
-      result[2] = 0x80 | ((code >> 6) & 0x3F);
-      result[3] = 0x80 | (code & 0x3F);
-    }
-  else
-    return false;
+  query_node_t *node = (query_node_t *) q->nodes.data + at;
 
-  if (!mstr_cat_cstr (mstr, result))
-    return false;
+  if (node->first == QUERY_NONE)
+    q->targets++;
 
-  return true;
+  q->next[id] = node->first;
+  node->first = id;
+  ret = true;
+
+err:
+  mstr_free (&key);
+  return ret;
 }
 
 static bool
-next_string (mstr_t *mstr, const char **psrc)
+query_match (const query_edge_t *edge, const char *key, size_t len,
+	     size_t index)
 {
-  if (**psrc != '"')
-    return false;
+  if (!key)
+    return (edge->kind & QUERY_INDEX) && edge->index == index;
 
-  const char *src = *psrc + 1;
+  return (edge->kind & QUERY_KEY) && mstr_len (&edge->key) == len
+	 && memcmp (mstr_data (&edge->key), key, len) == 0;
+}
 
-  for (char ch;;)
-    switch (ch = *src++)
-      {
-      case '"':
-	*psrc = src;
-	return true;
+static const char *
+query_scan (query_run_t *r, uint32_t at, const char *src, const char *end)
+{
+  const json_query_t *q = r->q;
+  const query_node_t *node = (query_node_t *) q->nodes.data + at;
+  const char *stop = NULL;
+  size_t index = 0, consumed;
 
-      case '\0':
-	goto err;
+  r->seen[at] = true;
 
-      case '\\':
-	switch (ch = *src++)
-	  {
-	  case '/':
-	    mstr_cat_char (mstr, '/');
-	    break;
+  /* the trie, not the input, bounds the recursion */
+  if (node->first != QUERY_NONE)
+    {
+      for (uint32_t id = node->first; id != QUERY_NONE; id = q->next[id])
+	if (!(r->results[id] = json_decode_n (src, end - src, &consumed)))
+	  return NULL;
 
-	  case '"':
-	    mstr_cat_char (mstr, '"');
-	    break;
+      /* nothing further to find, the caller stops too */
+      if (!--r->left)
+	return src;
 
-	  case '\\':
-	    mstr_cat_char (mstr, '\\');
-	    break;
+      stop = src + consumed;
+    }
 
-	  case 'b':
-	    mstr_cat_char (mstr, '\b');
-	    break;
+  /* a decoded target already told where it ends */
+  if (!node->edges.size || src >= end || (*src != '{' && *src != '['))
+    return stop ? stop : skip_value (src, end);
 
-	  case 'f':
-	    mstr_cat_char (mstr, '\f');
-	    break;
+  char close = *src == '{' ? '}' : ']';
 
-	  case 'n':
-	    mstr_cat_char (mstr, '\n');
-	    break;
+  src = skip_space (src + 1, end);
+  if (src < end && *src == close)
+    return src + 1;
 
-	  case 'r':
-	    mstr_cat_char (mstr, '\r');
-	    break;
+  for (;; index++)
+    {
+      const char *key = NULL;
+      const char *next = NULL;
+      size_t len = 0;
 
-	  case 't':
-	    mstr_cat_char (mstr, '\t');
-	    break;
+      if (close == '}')
+	{
+	  if (!(src = key_span (src, end, &r->scratch, &key, &len)))
+	    return NULL;
 
-	  case 'u':
-	    if (!next_unicode (mstr, src))
-	      goto err;
-	    src += 4;
-	    break;
+	  src = skip_space (src, end);
+	  if (src >= end || *src != ':')
+	    return NULL;
 
-	  default:
-	    goto err;
-	  }
-	break;
+	  src = skip_space (src + 1, end);
+	}
 
-      default:
-	if (!mstr_cat_char (mstr, ch))
-	  goto err;
-	break;
-      }
+      /* a pointer token and a dotted segment may name the same item */
+      for (size_t i = 0; i < node->edges.size; i++)
+	{
+	  const query_edge_t *edge = (query_edge_t *) node->edges.data + i;
 
-err:
-  mstr_free (mstr);
-  return false;
+	  if (r->seen[edge->node] || !query_match (edge, key, len, index))
+	    continue;
+
+	  if (!(next = query_scan (r, edge->node, src, end)) || !r->left)
+	    return next;
+	}
+
+      if (!(src = next ? next : skip_value (src, end)))
+	return NULL;
+
+      src = skip_space (src, end);
+      if (src < end && *src == close)
+	return src + 1;
+
+      if (src >= end || *src != ',')
+	return NULL;
+
+      src = skip_space (src + 1, end);
+    }
 }
 
-static inline int
-pair_comp (const rbtree_node_t *a, const rbtree_node_t *b)
+static void
+query_walk (const json_query_t *q, uint32_t at, const json_t *json,
+	    const json_t **results)
 {
-  const json_pair_t *pa = container_of (a, json_pair_t, node);
-  const json_pair_t *pb = container_of (b, json_pair_t, node);
-  return mstr_cmp_mstr (&pa->key, &pb->key);
+  const query_node_t *node = (query_node_t *) q->nodes.data + at;
+
+  for (uint32_t id = node->first; id != QUERY_NONE; id = q->next[id])
+    results[id] = json;
+
+  for (size_t i = 0; i < node->edges.size; i++)
+    {
+      const query_edge_t *edge = (query_edge_t *) node->edges.data + i;
+      const json_pair_t *pair;
+      const json_t *child = NULL;
+
+      if (json->type == JSON_OBJECT && (edge->kind & QUERY_KEY))
+	{
+	  pair = json_object_get_n (json, mstr_data (&edge->key),
+				    mstr_len (&edge->key));
+	  child = pair ? pair->value : NULL;
+	}
+      else if (json->type == JSON_ARRAY && (edge->kind & QUERY_INDEX))
+	child = json_array_get (json, edge->index);
+
+      if (child)
+	query_walk (q, edge->node, child, results);
+    }
 }
@@ -3,13 +3,44 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
+#include "arena.h"
 #include "array.h"
 #include "mstr.h"
-#include "rbtree.h"
 
 typedef struct json_t json_t;
+typedef struct json_doc_t json_doc_t;
+typedef struct json_key_t json_key_t;
+typedef struct json_cursor_t json_cursor_t;
+typedef struct json_parser_t json_parser_t;
+typedef struct json_query_t json_query_t;
+typedef struct json_sax_handler_t json_sax_handler_t;
 typedef struct json_pair_t json_pair_t;
+typedef struct json_index_t json_index_t;
+typedef struct json_object_t json_object_t;
+
+/* escape every non-ASCII code point as \uXXXX; invalid UTF-8 is
+   replaced with U+FFFD one byte at a time, whereas the default encoder
+   copies such bytes through unchanged */
+#define JSON_ENCODE_ASCII 1
+
+/* arena documents share one copy of each repeated out-of-line key; only
+   json_decode_arena_ex and json_decode_lines intern, json_decode_ex
+   builds heap trees that own every key and ignores the flag */
+#define JSON_DECODE_INTERN 1
+
+/* index every token in a SIMD pass first, then build the tree from the
+   index; results match json_decode, and like JSON_DECODE_INTERN only
+   json_decode_arena_ex and json_decode_lines honour it */
+#define JSON_DECODE_FAST 2
+
+/* json_decode_lines reports lines in input order */
+#define JSON_DECODE_ORDERED 4
+
+/* max_depth that leaves nesting bounded only by memory */
+#define JSON_DEPTH_UNLIMITED 0
 
 enum
 {
@@ -19,8 +50,41 @@ enum
   JSON_STRING,
   JSON_OBJECT,
   JSON_NUMBER,
+  JSON_INTEGER,
+  JSON_UINT,
+};
+
+struct json_pair_t
+{
+  json_t *value;
+  mstr_t key;
+};
+
+/* a lookup key prepared once by json_key_init and reused across calls;
+   data is borrowed and must outlive the handle */
+struct json_key_t
+{
+  const char *data;
+  size_t len;
+  uint64_t hash;
+  uint64_t prefix;
+  uint64_t mask;
+};
+
+/* pairs in insertion order, looked up through a hash index; pointers
+   into pairs stay valid until the object is next modified */
+struct json_object_t
+{
+  json_pair_t *pairs;
+  json_index_t *index;
+  uint32_t size;
+  uint32_t cap;
 };
 
+/* a number decodes as JSON_INTEGER when it is integral and fits int64_t,
+   as JSON_UINT when it only fits uint64_t and as JSON_NUMBER otherwise;
+   json_is_number holds for JSON_NUMBER alone, json_is_numeric for all
+   three */
 struct json_t
 {
   int type;
@@ -28,22 +92,69 @@ struct json_t
   {
     bool boolean;
     double number;
+    int64_t integer;
+    uint64_t uinteger;
     mstr_t string;
     array_t array;
-    rbtree_t object;
+    json_object_t object;
   } data;
 };
 
-struct json_pair_t
+/* a value inside raw JSON text; lookups walk the text on demand and
+   skip untouched values without allocating */
+struct json_cursor_t
 {
-  rbtree_node_t node;
-  json_t *value;
-  mstr_t key;
+  const char *src;
+  const char *end;
 };
 
+/* a decoded document whose nodes, pairs, arrays and strings all live in
+   one arena; treat it as read-only and release it with json_doc_free */
+struct json_doc_t
+{
+  json_t *root;
+  arena_t arena;
+};
+
+typedef bool json_sax_event_t (void *ctx);
+typedef bool json_sax_string_t (void *ctx, const char *data, size_t len);
+
+/* parse events, any callback may be NULL and returning false stops the
+   parse; string data is only valid during the call and points into the
+   input when the string has no escapes; integers are reported through
+   number when integer is NULL, and those above INT64_MAX through uinteger
+   when it is set; duplicate keys are not detected */
+struct json_sax_handler_t
+{
+  json_sax_event_t *start_object;
+  json_sax_event_t *end_object;
+  json_sax_event_t *start_array;
+  json_sax_event_t *end_array;
+  json_sax_string_t *key;
+  json_sax_string_t *string;
+  bool (*number) (void *ctx, double value);
+  bool (*integer) (void *ctx, int64_t value);
+  bool (*boolean) (void *ctx, bool value);
+  json_sax_event_t *null;
+  bool (*uinteger) (void *ctx, uint64_t value);
+};
+
+/* receives each non-blank line of json_decode_lines and its byte offset;
+   json is NULL for a line that does not hold exactly one value and is
+   only valid during the call; calls never overlap, returning false
+   stops decoding */
+typedef bool json_line_t (void *ctx, const json_t *json, size_t offset);
+
+/* receives each chunk of streamed output, returns false to abort */
+typedef bool json_writer_t (void *ctx, const char *data, size_t len);
+
 #define json_is_bool(JSON) ((JSON)->type == JSON_BOOL)
 #define json_is_array(JSON) ((JSON)->type == JSON_ARRAY)
 #define json_is_number(JSON) ((JSON)->type == JSON_NUMBER)
+#define json_is_integer(JSON) ((JSON)->type == JSON_INTEGER)
+#define json_is_uint(JSON) ((JSON)->type == JSON_UINT)
+#define json_is_numeric(JSON)						\
+  (json_is_number (JSON) || json_is_integer (JSON) || json_is_uint (JSON))
 #define json_is_string(JSON) ((JSON)->type == JSON_STRING)
 #define json_is_object(JSON) ((JSON)->type == JSON_OBJECT)
 
@@ -51,14 +162,105 @@ extern json_t *json_new (int type);
 extern void json_free (json_t *json);
 
 extern json_t *json_decode (const char *src);
+extern json_t *json_decode_n (const char *src, size_t len, size_t *consumed);
+extern json_t *json_decode_ex (const char *src, size_t len, size_t *consumed,
+			       int flags, size_t max_depth);
+extern bool json_sax_parse (const char *src, size_t len,
+			    const json_sax_handler_t *handler, void *ctx);
+extern bool json_sax_parse_ex (const char *src, size_t len,
+			       const json_sax_handler_t *handler, void *ctx,
+			       size_t max_depth);
+
+/* incremental decoder for one document fed in arbitrary chunks; finish
+   hands over the tree, the parser is released with json_parser_free */
+extern json_parser_t *json_parser_new (void);
+extern bool json_parser_feed (json_parser_t *p, const char *chunk,
+			      size_t len);
+extern json_t *json_parser_finish (json_parser_t *p);
+extern void json_parser_free (json_parser_t *p);
+
+extern bool json_decode_lines (const char *buf, size_t len, int nthreads,
+			       int flags, json_line_t *cb, void *ctx);
+
+extern json_t *json_decode_parallel (const char *src, size_t len,
+				    int nthreads);
+
+extern json_doc_t *json_decode_arena (const char *src);
+extern json_doc_t *json_decode_arena_n (const char *src, size_t len,
+					size_t *consumed);
+extern json_doc_t *json_decode_arena_ex (const char *src, size_t len,
+					 size_t *consumed, int flags,
+					 size_t max_depth);
+extern void json_doc_free (json_doc_t *doc);
+
+extern bool json_cursor_init (json_cursor_t *cur, const char *src,
+			      size_t len);
+extern int json_cursor_type (const json_cursor_t *cur);
+extern bool json_cursor_field (const json_cursor_t *cur, const char *key,
+			       json_cursor_t *out);
+extern bool json_cursor_field_n (const json_cursor_t *cur, const char *key,
+				 size_t len, json_cursor_t *out);
+extern bool json_cursor_index (const json_cursor_t *cur, size_t index,
+			       json_cursor_t *out);
+extern bool json_cursor_get_bool (const json_cursor_t *cur, bool *out);
+extern bool json_cursor_get_number (const json_cursor_t *cur, double *out);
+extern bool json_cursor_get_integer (const json_cursor_t *cur, int64_t *out);
+extern bool json_cursor_get_uint (const json_cursor_t *cur, uint64_t *out);
+extern bool json_cursor_get_string (const json_cursor_t *cur, mstr_t *out);
+extern json_t *json_cursor_decode (const json_cursor_t *cur);
+
+/* decodes only the value an RFC 6901 pointer such as "/items/3/price"
+   names, skipping the rest of the text; "" is the whole document */
+extern bool json_extract (const char *src, size_t len, const char *pointer,
+			  json_t **out);
+
+/* a fixed set of paths resolved together, each a JSON pointer or a
+   dotted path such as "$.items[3].price" or "$['a.b']"; run decodes
+   what exprs[i] names into results[i], eval points into a tree, and
+   paths that name nothing leave NULL */
+extern json_query_t *json_query_compile (const char *const *exprs, size_t n);
+extern bool json_query_run (const json_query_t *query, const char *src,
+			    size_t len, json_t **results);
+extern void json_query_eval (const json_query_t *query, const json_t *json,
+			     const json_t **results);
+extern void json_query_free (json_query_t *query);
+
 extern mstr_t *json_encode (mstr_t *mstr, const json_t *json);
+extern mstr_t *json_encode_ex (mstr_t *mstr, const json_t *json, int flags);
+extern mstr_t *json_encode_lines (mstr_t *mstr, const json_t *const *items,
+				  size_t n);
+extern mstr_t *json_encode_parallel (mstr_t *mstr, const json_t *json,
+				     int nthreads);
+
+/* the exact length json_encode writes, and the same text written into
+   buf without a terminator, 0 when cap is too small; neither allocates
+   for documents nested up to 32 levels, deeper ones move the traversal
+   stack to the heap and return 0 if that allocation fails */
+extern size_t json_encoded_size (const json_t *json);
+extern size_t json_encode_buf (char *buf, size_t cap, const json_t *json);
+
+extern bool json_encode_stream (const json_t *json, json_writer_t *write,
+				void *ctx);
+extern bool json_encode_fd (const json_t *json, int fd);
+extern bool json_encode_file (const json_t *json, FILE *file);
 
 extern bool json_array_add (json_t *json, json_t *new);
 extern json_t *json_array_take (json_t *json, size_t index);
 extern json_t *json_array_get (const json_t *json, size_t index);
 
+/* add copies the key and value of a malloc'd pair into the object and
+   frees new on success, the caller keeps it on failure; take moves the
+   pair named by key into out and returns false when there is none */
 extern bool json_object_add (json_t *json, json_pair_t *new);
-extern json_pair_t *json_object_take (json_t *json, const char *key);
+extern bool json_object_take (json_t *json, const char *key,
+			      json_pair_t *out);
 extern json_pair_t *json_object_get (const json_t *json, const char *key);
+extern json_pair_t *json_object_get_n (const json_t *json, const char *key,
+				       size_t len);
+extern json_pair_t *json_object_get_key (const json_t *json,
+					 const json_key_t *key);
+
+extern json_key_t *json_key_init (json_key_t *key, const char *data,
+				  size_t len);
 
 #endif
@@ -75,6 +75,17 @@ mstr_reserve (mstr_t *str, size_t n)
   return str;
 }
 
+mstr_t *
+mstr_set_len (mstr_t *str, size_t len)
+{
+  if (len >= mstr_cap (str))
+    /* out of range */
+    return NULL;
+
+  set_len (str, len);
+  return str;
+}
+
 mstr_t *
 mstr_remove (mstr_t *str, size_t start, size_t n)
 {
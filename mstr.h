@@ -63,6 +63,10 @@ extern void mstr_clear (mstr_t *str) attr_nonnull (1);
 
 extern mstr_t *mstr_reserve (mstr_t *str, size_t cap) attr_nonnull (1);
 
+/* set length */
+
+extern mstr_t *mstr_set_len (mstr_t *str, size_t len) attr_nonnull (1);
+
 /* remove */
 
 extern mstr_t *mstr_remove (mstr_t *str, size_t start, size_t n)
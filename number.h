@@ -0,0 +1,44 @@
+#ifndef NUMBER_H
+#define NUMBER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMBER_REAL 0
+#define NUMBER_INTEGER 1
+#define NUMBER_UINT 2
+
+/* enough for any int64_t, uint64_t or finite double in decimal */
+#define NUMBER_INTEGER_LEN 20
+#define NUMBER_REAL_LEN 32
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct number_t number_t;
+
+struct number_t
+{
+  int type;
+  union
+  {
+    double real;
+    int64_t integer;
+    uint64_t uinteger;
+  };
+};
+
+/* parse one JSON number starting at src, never reading at or past end;
+   returns the end of the number or NULL if it is malformed */
+extern const char *number_parse (const char *src, const char *end,
+				 number_t *out) attr_nonnull (1, 2, 3);
+
+/* write num in decimal without a terminator; returns the length */
+extern size_t number_format_integer (char *buf, int64_t num)
+    attr_nonnull (1);
+extern size_t number_format_uint (char *buf, uint64_t num) attr_nonnull (1);
+
+/* write a finite num in a short form that round-trips (Grisu2, not
+   always shortest) */
+extern size_t number_format_real (char *buf, double num) attr_nonnull (1);
+
+#endif
@@ -0,0 +1,216 @@
+#include "structural.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define EVEN_BITS UINT64_C (0x5555555555555555)
+
+#if defined(__AVX2__)
+#define VEC_LEN 32
+typedef __m256i vec_t;
+#define vec_load(src) _mm256_loadu_si256 ((const __m256i *) (src))
+#define vec_or(v, c) _mm256_or_si256 ((v), _mm256_set1_epi8 (c))
+#define vec_eq(v, c)                                                          \
+  (uint32_t) _mm256_movemask_epi8 (                                          \
+      _mm256_cmpeq_epi8 ((v), _mm256_set1_epi8 (c)))
+#define vec_ctrl(v)                                                           \
+  (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (                       \
+      _mm256_min_epu8 ((v), _mm256_set1_epi8 (0x1f)), (v)))
+#elif defined(__SSE2__)
+#define VEC_LEN 16
+typedef __m128i vec_t;
+#define vec_load(src) _mm_loadu_si128 ((const __m128i *) (src))
+#define vec_or(v, c) _mm_or_si128 ((v), _mm_set1_epi8 (c))
+#define vec_eq(v, c)                                                          \
+  (uint32_t) _mm_movemask_epi8 (_mm_cmpeq_epi8 ((v), _mm_set1_epi8 (c)))
+#define vec_ctrl(v)                                                           \
+  (uint32_t) _mm_movemask_epi8 (                                             \
+      _mm_cmpeq_epi8 (_mm_min_epu8 ((v), _mm_set1_epi8 (0x1f)), (v)))
+#endif
+
+typedef struct block_t block_t;
+
+struct block_t
+{
+  uint64_t backslash;
+  uint64_t quote;
+  uint64_t op;
+  uint64_t ws;
+  uint64_t ctrl;
+};
+
+static inline void
+block_classify (block_t *b, const char *src)
+{
+  *b = (block_t) {};
+
+#ifdef VEC_LEN
+  for (int i = 0; i < STRUCTURAL_BLOCK; i += VEC_LEN)
+    {
+      vec_t v = vec_load (src + i);
+      /* '[' and ']' differ from '{' and '}' only in bit 5 */
+      vec_t lower = vec_or (v, 0x20);
+
+      uint64_t op = vec_eq (lower, '{') | vec_eq (lower, '}')
+		    | vec_eq (v, ':') | vec_eq (v, ',');
+      uint64_t ws = vec_eq (v, ' ') | vec_eq (v, '\t') | vec_eq (v, '\n')
+		    | vec_eq (v, '\r');
+
+      b->backslash |= (uint64_t) vec_eq (v, '\\') << i;
+      b->quote |= (uint64_t) vec_eq (v, '"') << i;
+      b->op |= op << i;
+      b->ws |= ws << i;
+      b->ctrl |= (uint64_t) vec_ctrl (v) << i;
+    }
+#else
+  for (int i = 0; i < STRUCTURAL_BLOCK; i++)
+    {
+      uint64_t bit = (uint64_t) 1 << i;
+
+      switch (src[i])
+	{
+	case '\\':
+	  b->backslash |= bit;
+	  break;
+
+	case '"':
+	  b->quote |= bit;
+	  break;
+
+	case '{':
+	case '}':
+	case '[':
+	case ']':
+	case ':':
+	case ',':
+	  b->op |= bit;
+	  break;
+
+	case ' ':
+	case '\t':
+	case '\n':
+	case '\r':
+	  b->ws |= bit;
+	  break;
+	}
+
+      if ((unsigned char) src[i] < 0x20)
+	b->ctrl |= bit;
+    }
+#endif
+}
+
+static inline uint64_t
+find_escaped (uint64_t backslash, uint64_t *prev_escaped)
+{
+  /* a character is escaped when an odd run of backslashes precedes it;
+     runs are told apart by the parity of the bit they start on */
+  backslash &= ~*prev_escaped;
+
+  uint64_t follows = backslash << 1 | *prev_escaped;
+  uint64_t odd_starts = backslash & ~EVEN_BITS & ~follows;
+  uint64_t even_starts;
+
+  *prev_escaped = __builtin_add_overflow (odd_starts, backslash, &even_starts);
+
+  return (EVEN_BITS ^ (even_starts << 1)) & follows;
+}
+
+static inline uint64_t
+prefix_xor (uint64_t bits)
+{
+#ifdef __PCLMUL__
+  __m128i all = _mm_set1_epi8 ((char) 0xff);
+  __m128i v = _mm_set_epi64x (0, (long long) bits);
+  return _mm_cvtsi128_si64 (_mm_clmulepi64_si128 (v, all, 0));
+#else
+  bits ^= bits << 1;
+  bits ^= bits << 2;
+  bits ^= bits << 4;
+  bits ^= bits << 8;
+  bits ^= bits << 16;
+  bits ^= bits << 32;
+  return bits;
+#endif
+}
+
+static bool
+structural_expand (structural_t *index)
+{
+  size_t cap = index->cap;
+  uint32_t *pos = index->pos;
+
+  if (!(cap = cap * 2))
+    cap = STRUCTURAL_BLOCK * 16;
+
+  if (!(pos = realloc (pos, cap * sizeof (*pos))))
+    return false;
+
+  index->pos = pos;
+  index->cap = cap;
+  return true;
+}
+
+bool
+structural_index (structural_t *index, const char *src, size_t len)
+{
+  uint64_t prev_escaped = 0, prev_string = 0, prev_scalar = 0;
+  char tail[STRUCTURAL_BLOCK];
+
+  index->size = 0;
+
+  for (size_t at = 0; at < len; at += STRUCTURAL_BLOCK)
+    {
+      const char *data = src + at;
+      block_t b;
+
+      /* the last partial block is padded with whitespace */
+      if (len - at < STRUCTURAL_BLOCK)
+	{
+	  memset (tail, ' ', STRUCTURAL_BLOCK);
+	  memcpy (tail, data, len - at);
+	  data = tail;
+	}
+
+      if (index->cap - index->size < STRUCTURAL_BLOCK
+	  && !structural_expand (index))
+	return false;
+
+      block_classify (&b, data);
+
+      uint64_t quote = b.quote & ~find_escaped (b.backslash, &prev_escaped);
+      uint64_t string = prefix_xor (quote) ^ prev_string;
+      prev_string = (uint64_t) ((int64_t) string >> 63);
+
+      /* scalars start wherever a non-whitespace, non-operator byte does
+	 not continue one; quotes never continue a scalar */
+      uint64_t scalar = ~(b.op | b.ws) & ~quote;
+      uint64_t follows = scalar << 1 | prev_scalar;
+      prev_scalar = scalar >> 63;
+
+      /* both quotes of a string are kept so it can be copied without
+	 a scan, unless a backslash or control byte inside says not to */
+      uint64_t body = string & ~quote;
+      uint64_t bits = ((b.op | (scalar & ~follows)) & ~string) | quote
+		      | ((b.backslash | b.ctrl) & body);
+
+      uint32_t *pos = index->pos + index->size;
+      index->size += __builtin_popcountll (bits);
+
+      for (; bits; bits &= bits - 1)
+	*pos++ = at + __builtin_ctzll (bits);
+    }
+
+  return true;
+}
+
+void
+structural_free (structural_t *index)
+{
+  free (index->pos);
+  *index = STRUCTURAL_INIT;
+}
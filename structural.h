@@ -0,0 +1,32 @@
+#ifndef STRUCTURAL_H
+#define STRUCTURAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define STRUCTURAL_BLOCK 64
+
+#define attr_nonnull(...) __attribute__ ((nonnull (__VA_ARGS__)))
+
+typedef struct structural_t structural_t;
+
+/* offsets of every structural character and scalar start outside
+   strings, of both quotes of each string and of the backslashes and
+   control bytes inside strings, in input order */
+struct structural_t
+{
+  uint32_t *pos;
+  size_t size;
+  size_t cap;
+};
+
+#define STRUCTURAL_INIT                                                       \
+  (structural_t) {}
+
+extern bool structural_index (structural_t *index, const char *src,
+			      size_t len) attr_nonnull (1);
+
+extern void structural_free (structural_t *index) attr_nonnull (1);
+
+#endif
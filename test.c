@@ -1,10 +1,1478 @@
 #include "json.h"
 
+#include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 char buff[4096];
 
+static void
+fail (const char *what)
+{
+  printf ("%s failed\n", what);
+  exit (1);
+}
+
+/* json encodes to exactly text; a NULL json only matches a NULL text */
+static bool
+encodes_to (const json_t *json, const char *text)
+{
+  mstr_t out = MSTR_INIT;
+  bool ret;
+
+  if (!json || !text)
+    return !json && !text;
+
+  ret = json_encode (&out, json) && strcmp (mstr_data (&out), text) == 0;
+
+  mstr_free (&out);
+  return ret;
+}
+
+static bool
+same (const json_t *a, const json_t *b)
+{
+  mstr_t x = MSTR_INIT;
+  bool ret;
+
+  if (!a || !b)
+    return a == b;
+
+  ret = json_encode (&x, a) && encodes_to (b, mstr_data (&x));
+
+  mstr_free (&x);
+  return ret;
+}
+
+static uint64_t
+next_random (uint64_t *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static void
+test_arena (const json_t *json, size_t len)
+{
+  json_doc_t *doc;
+
+  if (!(doc = json_decode_arena_n (buff, len, NULL)))
+    fail ("arena decode");
+
+  if (!same (json, doc->root))
+    fail ("arena decode");
+
+  json_doc_free (doc);
+
+  if ((doc = json_decode_arena ("{\"a\": [1, 2,]}")))
+    fail ("arena decode error");
+
+  json_doc_free (NULL);
+}
+
+static void
+test_bounded (void)
+{
+  static const char text[] = { '[', '"', 'a', '"', ']' };
+  size_t consumed = 0;
+  json_t *json;
+
+  /* the input is not terminated, only its length bounds the parse */
+  json = json_decode_n (text, sizeof (text), &consumed);
+  if (!encodes_to (json, "[\"a\"]") || consumed != sizeof (text))
+    fail ("bounded decode");
+  json_free (json);
+
+  json = json_decode_n ("123 trailing", 12, &consumed);
+  if (!encodes_to (json, "123") || consumed != 3)
+    fail ("bounded decode consumed");
+  json_free (json);
+
+  json = json_decode_n ("1234", 2, NULL);
+  if (!encodes_to (json, "12"))
+    fail ("bounded decode number");
+  json_free (json);
+
+  if ((json = json_decode_n ("[1, 2]", 5, NULL)))
+    fail ("bounded decode cut");
+}
+
+static void
+test_strings (void)
+{
+  char text[96];
+  json_t *json;
+
+  /* an escape, a raw control byte and a missing quote at every offset
+     around the 16 and 32 byte scan blocks */
+  for (size_t len = 0; len < 70; len++)
+    for (size_t at = 0; at <= len; at++)
+      {
+	text[0] = '"';
+	memset (text + 1, 'a', len + 2);
+	text[1 + at] = '\\';
+	text[2 + at] = '"';
+	text[len + 3] = '"';
+	text[len + 4] = '\0';
+
+	json = json_decode (text);
+	if (!encodes_to (json, text))
+	  fail ("string escape");
+	json_free (json);
+
+	text[1 + at] = '\1';
+	if ((json = json_decode (text)))
+	  fail ("string control byte");
+
+	text[1 + at] = text[2 + at] = 'a';
+	if ((json = json_decode_n (text, len + 3, NULL)))
+	  fail ("string unterminated");
+      }
+}
+
+static void
+test_whitespace (void)
+{
+  static const char ws[] = " \t\n\r";
+  char text[128];
+  json_t *json;
+
+  /* runs long enough for the vector scan, ending at every offset */
+  for (size_t len = 0; len < 40; len++)
+    {
+      size_t at = 0;
+
+      text[at++] = '[';
+      for (size_t i = 0; i < len; i++)
+	text[at++] = ws[i % 4];
+      text[at++] = '1';
+      for (size_t i = 0; i < len; i++)
+	text[at++] = ws[(i + 1) % 4];
+      text[at++] = ']';
+      text[at] = '\0';
+
+      json = json_decode (text);
+      if (!encodes_to (json, "[1]"))
+	fail ("whitespace");
+      json_free (json);
+    }
+
+  /* isspace accepts these, JSON does not */
+  if ((json = json_decode ("[\v1]")) || (json = json_decode ("[1\f]")))
+    fail ("whitespace non-json");
+}
+
+static void
+test_parse_real (void)
+{
+  /* exact halfway cases, subnormals and the extremes of the range */
+  static const struct
+  {
+    const char *text;
+    double value;
+  } reals[] = {
+    { "0.1", 0.1 },
+    { "-0.0", -0.0 },
+    { "1.5e3", 1500.0 },
+    { "1e-320", 1e-320 },
+    { "4.9406564584124654e-324", 0x1p-1074 },
+    { "2.2250738585072014e-308", 0x1p-1022 },
+    { "1.7976931348623157e308", 0x1.fffffffffffffp1023 },
+    { "0.30000000000000004", 0.30000000000000004 },
+    { "1.00000000000000011102230246251565404236316680908203125", 1.0 },
+    { "1.00000000000000011102230246251565404236316680908203125001",
+      0x1.0000000000001p0 },
+    { "100000000000000000000000000000000000000000e-40", 10.0 },
+  };
+
+  static const char *const bad[] = {
+    "1.", ".5", "-", "1e", "+1", "1e+", "-.1", "[0x10]",
+  };
+
+  json_t *json;
+
+  for (size_t i = 0; i < sizeof (reals) / sizeof (*reals); i++)
+    {
+      if (!(json = json_decode (reals[i].text)) || json->type != JSON_NUMBER
+	  || memcmp (&json->data.number, &reals[i].value, sizeof (double)))
+	fail ("parse real");
+      json_free (json);
+    }
+
+  for (size_t i = 0; i < sizeof (bad) / sizeof (*bad); i++)
+    if ((json = json_decode (bad[i])))
+      fail ("parse real error");
+}
+
+static void
+test_integers (void)
+{
+  const char *text = "[9007199254740993,-1,18446744073709551615,1.5]";
+  json_t *json, *item;
+
+  if (!(json = json_decode (text)))
+    fail ("integer decode");
+
+  /* beyond 2^53 the value survives only as an integer */
+  item = json_array_get (json, 0);
+  if (!json_is_integer (item) || item->data.integer != 9007199254740993
+      || json_is_number (item) || !json_is_numeric (item))
+    fail ("integer kind");
+
+  item = json_array_get (json, 1);
+  if (!json_is_integer (item) || item->data.integer != -1)
+    fail ("integer negative");
+
+  item = json_array_get (json, 2);
+  if (!json_is_uint (item) || item->data.uinteger != UINT64_MAX
+      || !json_is_numeric (item))
+    fail ("integer unsigned");
+
+  item = json_array_get (json, 3);
+  if (!json_is_number (item) || item->data.number != 1.5
+      || !json_is_numeric (item))
+    fail ("integer real");
+
+  if (!encodes_to (json, text))
+    fail ("integer encode");
+  json_free (json);
+
+  /* past both ranges the value is real */
+  json = json_decode ("[-9223372036854775808,-9223372036854775809]");
+  if (!json || !json_is_integer (json_array_get (json, 0))
+      || json_array_get (json, 0)->data.integer != INT64_MIN
+      || !json_is_number (json_array_get (json, 1)))
+    fail ("integer range");
+  json_free (json);
+}
+
+static void
+test_format_real (void)
+{
+  /* one switch to the exponent form on both sides of 10^15, integral
+     or not */
+  static const struct
+  {
+    double value;
+    const char *text;
+  } reals[] = {
+    { 0.0, "0.0" },
+    { -0.0, "-0.0" },
+    { 1.5, "1.5" },
+    { 0.1, "0.1" },
+    { 123.456, "123.456" },
+    { 0.0001, "0.0001" },
+    { 0.00001, "1e-5" },
+    { 0.00012345, "0.00012345" },
+    { 999999999999999.0, "999999999999999.0" },
+    { 99999999999999.5, "99999999999999.5" },
+    { 1e15, "1e15" },
+    { 1000000000000001.0, "1.000000000000001e15" },
+    { 9007199254740992.0, "9.007199254740992e15" },
+    { 9007199254740994.0, "9.007199254740994e15" },
+    { 1e300, "1e300" },
+    { 0x1p-1074, "5e-324" },
+    { 0x1.fffffffffffffp1023, "1.7976931348623157e308" },
+  };
+
+  uint64_t state = 0x9E3779B97F4A7C15;
+  json_t *json, *back;
+
+  if (!(json = json_new (JSON_NUMBER)))
+    fail ("format real");
+
+  for (size_t i = 0; i < sizeof (reals) / sizeof (*reals); i++)
+    {
+      json->data.number = reals[i].value;
+      if (!encodes_to (json, reals[i].text))
+	fail ("format real");
+    }
+
+  /* random bit patterns come back unchanged */
+  for (int i = 0; i < 100000; i++)
+    {
+      mstr_t out = MSTR_INIT;
+
+      next_random (&state);
+      memcpy (&json->data.number, &state, sizeof (double));
+
+      if (isnan (json->data.number) || isinf (json->data.number))
+	continue;
+
+      if (!json_encode (&out, json) || !(back = json_decode (mstr_data (&out)))
+	  || !json_is_number (back)
+	  || memcmp (&back->data.number, &state, sizeof (double)))
+	fail ("format real round trip");
+
+      json_free (back);
+      mstr_free (&out);
+    }
+
+  json_free (json);
+}
+
+static bool
+encodes_ascii_to (const json_t *json, const char *text)
+{
+  mstr_t out = MSTR_INIT;
+  bool ret = json_encode_ex (&out, json, JSON_ENCODE_ASCII)
+	     && strcmp (mstr_data (&out), text) == 0;
+
+  mstr_free (&out);
+  return ret;
+}
+
+static void
+test_escape (void)
+{
+  static const char raw[] = "a\xc3\xa9\xf0\x9f\x98\x80\x01\"\\\n\x7f";
+  json_t *json;
+
+  if (!(json = json_new (JSON_STRING))
+      || !mstr_assign_byte (&json->data.string, raw, sizeof (raw) - 1))
+    fail ("escape");
+
+  if (!encodes_to (json, "\"a\xc3\xa9\xf0\x9f\x98\x80"
+			 "\\u0001\\\"\\\\\\n\x7f\""))
+    fail ("escape utf-8");
+
+  if (!encodes_ascii_to (json, "\"a\\u00e9\\ud83d\\ude00"
+			       "\\u0001\\\"\\\\\\n\x7f\""))
+    fail ("escape ascii");
+
+  /* malformed bytes pass through, or become U+FFFD one at a time */
+  if (!mstr_assign_byte (&json->data.string, "\xff\xc3(", 3))
+    fail ("escape");
+
+  if (!encodes_to (json, "\"\xff\xc3(\"")
+      || !encodes_ascii_to (json, "\"\\ufffd\\ufffd(\""))
+    fail ("escape invalid utf-8");
+
+  json_free (json);
+}
+
+static void
+test_encode_size (const json_t *json, const mstr_t *text)
+{
+  size_t len = mstr_len (text);
+  char *buf;
+
+  if (json_encoded_size (json) != len)
+    fail ("encoded size");
+
+  if (!(buf = malloc (len)))
+    fail ("encode buf");
+
+  /* exactly enough room, and one byte short of it */
+  if (json_encode_buf (buf, len, json) != len
+      || memcmp (buf, mstr_data (text), len) != 0)
+    fail ("encode buf");
+
+  if (json_encode_buf (buf, len - 1, json) != 0)
+    fail ("encode buf short");
+
+  free (buf);
+}
+
+static bool
+write_mstr (void *ctx, const char *data, size_t len)
+{
+  return mstr_cat_byte (ctx, data, len);
+}
+
+static bool
+write_none (void *ctx, const char *data, size_t len)
+{
+  (void) data;
+  (void) len;
+  return --*(int *) ctx > 0;
+}
+
+static void
+test_stream (const json_t *json, const mstr_t *text)
+{
+  mstr_t out = MSTR_INIT, big = MSTR_INIT;
+  json_t *array;
+  char line[64];
+  int calls = 2;
+
+  if (!json_encode_stream (json, write_mstr, &out)
+      || strcmp (mstr_data (&out), mstr_data (text)) != 0)
+    fail ("encode stream");
+  mstr_clear (&out);
+
+  /* output larger than the buffer arrives in several chunks */
+  if (!(array = json_new (JSON_ARRAY)))
+    fail ("encode stream");
+
+  for (int i = 0; i < 2000; i++)
+    {
+      json_t *item = json_new (JSON_STRING);
+      int n = snprintf (line, sizeof (line), "item %d", i);
+
+      if (!item || !mstr_assign_byte (&item->data.string, line, n)
+	  || !json_array_add (array, item))
+	fail ("encode stream");
+    }
+
+  if (!json_encode (&big, array)
+      || !json_encode_stream (array, write_mstr, &out)
+      || strcmp (mstr_data (&out), mstr_data (&big)) != 0)
+    fail ("encode stream chunks");
+
+  /* a writer that refuses the second chunk aborts the encode */
+  if (json_encode_stream (array, write_none, &calls))
+    fail ("encode stream abort");
+
+  FILE *file = tmpfile ();
+  if (!file || !json_encode_file (array, file))
+    fail ("encode file");
+
+  rewind (file);
+  mstr_clear (&out);
+  for (size_t n; (n = fread (line, 1, sizeof (line), file));)
+    mstr_cat_byte (&out, line, n);
+
+  if (strcmp (mstr_data (&out), mstr_data (&big)) != 0)
+    fail ("encode file");
+
+  fclose (file);
+  json_free (array);
+  mstr_free (&big);
+  mstr_free (&out);
+}
+
+#define CHURN_KEYS 64
+
+/* every third key is too long to be stored inline */
+static size_t
+churn_key (char *buf, int id)
+{
+  return sprintf (buf, id % 3 ? "key %d" : "a key too long to be inline %d",
+		  id);
+}
+
+/* the pairs hold the ids of order in sequence, all found by lookups */
+static void
+churn_check (const json_t *json, const int *order, int size)
+{
+  const json_object_t *object = &json->data.object;
+  char key[64];
+
+  if (object->size != (uint32_t) size)
+    fail ("object churn size");
+
+  for (int i = 0; i < size; i++)
+    {
+      size_t len = churn_key (key, order[i]);
+      json_pair_t *pair = object->pairs + i;
+      json_key_t handle;
+
+      if (mstr_len (&pair->key) != len
+	  || memcmp (mstr_data (&pair->key), key, len) != 0
+	  || pair->value->data.integer != order[i])
+	fail ("object churn order");
+
+      if (json_object_get (json, key) != pair
+	  || json_object_get_n (json, key, len) != pair
+	  || json_object_get_key (json, json_key_init (&handle, key, len))
+		 != pair)
+	fail ("object churn lookup");
+    }
+}
+
+static void
+test_object_churn (void)
+{
+  uint64_t state = 0x2545F4914F6CDD1D;
+  char key[64];
+
+  for (int round = 0; round < 20; round++)
+    {
+      bool present[CHURN_KEYS] = {};
+      int order[CHURN_KEYS];
+      int size = 0;
+      json_t *json;
+
+      if (!(json = json_new (JSON_OBJECT)))
+	fail ("object churn");
+
+      /* alternate between growing past the linear-scan limit and
+	 shrinking below it, taking from both ends and the middle */
+      for (int step = 0; step < 400; step++)
+	{
+	  uint64_t r = next_random (&state);
+	  bool grow = step / 50 % 2 == 0;
+	  int id = r % CHURN_KEYS;
+
+	  if (size && r / CHURN_KEYS % 4 >= (grow ? 3u : 1u))
+	    {
+	      int at = r / CHURN_KEYS / 4 % size;
+	      json_pair_t pair;
+
+	      id = order[at];
+	      churn_key (key, id);
+
+	      if (!json_object_take (json, key, &pair)
+		  || pair.value->data.integer != id
+		  || json_object_take (json, key, &pair))
+		fail ("object churn take");
+
+	      mstr_free (&pair.key);
+	      json_free (pair.value);
+	      present[id] = false;
+	      memmove (order + at, order + at + 1,
+		       (--size - at) * sizeof (int));
+	    }
+	  else
+	    {
+	      json_pair_t *pair = malloc (sizeof (json_pair_t));
+	      json_t *value = json_new (JSON_INTEGER);
+	      size_t len = churn_key (key, id);
+
+	      if (!pair || !value)
+		fail ("object churn");
+
+	      value->data.integer = id;
+	      *pair = (json_pair_t) { .value = value, .key = MSTR_INIT };
+
+	      if (!mstr_assign_byte (&pair->key, key, len))
+		fail ("object churn");
+
+	      /* a duplicate is refused and stays with the caller */
+	      if (json_object_add (json, pair) == present[id])
+		fail ("object churn add");
+
+	      if (present[id])
+		{
+		  mstr_free (&pair->key);
+		  json_free (value);
+		  free (pair);
+		}
+	      else
+		{
+		  present[id] = true;
+		  order[size++] = id;
+		}
+	    }
+
+	  churn_check (json, order, size);
+	}
+
+      json_free (json);
+    }
+}
+
+static void
+test_small_object (void)
+{
+  /* keys equal in their first 7 bytes and differing in the tail or the
+     length, and the empty key */
+  static const char *const keys[] = {
+    "", "abcdefg", "abcdefgh1", "abcdefgh2", "abcdefgh", "abcdefgh12",
+  };
+
+  const char *small = "{\"\":0,\"abcdefg\":1,\"abcdefgh1\":2,"
+		      "\"abcdefgh2\":3,\"abcdefgh\":4,\"abcdefgh12\":5}";
+  const char *large = "{\"\":0,\"abcdefg\":1,\"abcdefgh1\":2,"
+		      "\"abcdefgh2\":3,\"abcdefgh\":4,\"abcdefgh12\":5,"
+		      "\"x\":6,\"y\":7,\"z\":8}";
+  json_t *json;
+
+  for (int i = 0; i < 2; i++)
+    {
+      if (!(json = json_decode (i ? large : small)))
+	fail ("small object");
+
+      /* only objects past the limit carry an index */
+      if (!json->data.object.index != !i)
+	fail ("small object index");
+
+      for (size_t k = 0; k < sizeof (keys) / sizeof (*keys); k++)
+	{
+	  json_pair_t *pair = json_object_get (json, keys[k]);
+	  if (!pair || pair->value->data.integer != (int64_t) k)
+	    fail ("small object lookup");
+	}
+
+      if (json_object_get (json, "abcdefgh3") || json_object_get (json, "a")
+	  || !encodes_to (json, i ? large : small))
+	fail ("small object");
+      json_free (json);
+    }
+
+  /* duplicates are refused whether or not there is an index */
+  if ((json = json_decode ("{\"abcdefgh1\":1,\"abcdefgh1\":2}"))
+      || (json = json_decode ("{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,"
+			      "\"f\":6,\"g\":7,\"h\":8,\"a\":9}")))
+    fail ("small object duplicate");
+}
+
+static void
+test_intern (void)
+{
+  const char *text = "[{\"a key long enough to be shared\":1,\"id\":1},"
+		     "{\"id\":2,\"a key long enough to be shared\":2}]";
+  const char *key = "a key long enough to be shared";
+
+  for (int flags = 0; flags <= JSON_DECODE_INTERN; flags++)
+    {
+      json_doc_t *doc;
+      json_pair_t *a, *b;
+
+      doc = json_decode_arena_ex (text, strlen (text), NULL, flags, 0);
+      if (!doc || !encodes_to (doc->root, text))
+	fail ("intern");
+
+      a = json_object_get (json_array_get (doc->root, 0), key);
+      b = json_object_get (json_array_get (doc->root, 1), key);
+
+      /* repeated long keys are one copy only when interning */
+      if (!a || !b || a->value->data.integer != 1
+	  || b->value->data.integer != 2
+	  || (mstr_data (&a->key) == mstr_data (&b->key)) != !!flags)
+	fail ("intern keys");
+
+      json_doc_free (doc);
+    }
+}
+
+static void
+test_key_handle (void)
+{
+  const char *text = "[{\"price\":1},{\"a\":0,\"price\":2},"
+		     "{\"a\":0,\"b\":0,\"c\":0,\"d\":0,\"e\":0,\"f\":0,"
+		     "\"g\":0,\"h\":0,\"price\":3},{\"a\\u0000b\":4}]";
+  json_key_t price, missing;
+  json_pair_t *pair;
+  json_t *json;
+
+  if (!(json = json_decode (text)))
+    fail ("key handle");
+
+  /* one handle serves small and indexed objects alike */
+  json_key_init (&price, "price", 5);
+  json_key_init (&missing, "pric", 4);
+
+  for (size_t i = 0; i < 3; i++)
+    {
+      pair = json_object_get_key (json_array_get (json, i), &price);
+      if (!pair || pair->value->data.integer != (int64_t) i + 1
+	  || json_object_get_key (json_array_get (json, i), &missing))
+	fail ("key handle lookup");
+    }
+
+  /* length-taking lookups need no terminator and allow NUL bytes */
+  pair = json_object_get_n (json_array_get (json, 3), "a\0b", 3);
+  if (!pair || pair->value->data.integer != 4
+      || !json_object_get_n (json_array_get (json, 0), "prices", 5)
+      || json_object_get_n (json_array_get (json, 3), "a", 1))
+    fail ("key length lookup");
+
+  json_free (json);
+}
+
+/* the fast arena decode agrees with json_decode_n on the tree, on
+   failure and on the consumed count */
+static void
+check_fast (const char *src, size_t len)
+{
+  size_t plain_len = 0, fast_len = 0;
+  json_t *plain = json_decode_n (src, len, &plain_len);
+  json_doc_t *fast;
+
+  fast = json_decode_arena_ex (src, len, &fast_len, JSON_DECODE_FAST, 0);
+
+  if (!same (plain, fast ? fast->root : NULL) || plain_len != fast_len)
+    fail ("fast decode");
+
+  json_free (plain);
+  json_doc_free (fast);
+}
+
+static void
+test_fast (size_t len)
+{
+  static const char *const docs[] = {
+    "[12x]", "[1 2]", "[1,]", "{\"a\":1}x", "{\"a\" 1}", "[tru]",
+    "[true,false,null,-0.5e3,\"\\\"\\\\\\u00e9\"]", " 17 ", "\"x\"y",
+    "[\"a\\\\\",\"b\\\\\\\"c\"]", "[\"ctl\x01\"]",
+    "{\"k\":[{},[],{\"\":\"\"}]}",
+  };
+
+  char text[160];
+
+  check_fast (buff, len);
+
+  for (size_t i = 0; i < sizeof (docs) / sizeof (*docs); i++)
+    check_fast (docs[i], strlen (docs[i]));
+
+  /* strings and escapes straddling the 64-byte index blocks */
+  for (size_t at = 0; at < 140; at++)
+    {
+      memset (text, ' ', sizeof (text));
+      memcpy (text, "[\"", 2);
+      memset (text + 2, 'a', at);
+      memcpy (text + 2 + at, "\\\"\",1]", 6);
+      check_fast (text, at + 8);
+      check_fast (text, sizeof (text));
+    }
+}
+
+static void
+test_cursor (const json_t *json, size_t len)
+{
+  json_cursor_t root, cur, other;
+  mstr_t str = MSTR_INIT;
+  int64_t integer;
+  uint64_t uinteger;
+  double number;
+  json_t *sub;
+  bool flag;
+
+  if (!json_cursor_init (&root, buff, len)
+      || json_cursor_type (&root) != JSON_OBJECT)
+    fail ("cursor");
+
+  if (!json_cursor_field (&root, "age", &cur)
+      || json_cursor_type (&cur) != JSON_INTEGER
+      || !json_cursor_get_integer (&cur, &integer) || integer != 20
+      || !json_cursor_get_number (&cur, &number) || number != 20)
+    fail ("cursor integer");
+
+  if (!json_cursor_field (&root, "student", &cur)
+      || json_cursor_type (&cur) != JSON_BOOL
+      || !json_cursor_get_bool (&cur, &flag) || !flag
+      || json_cursor_get_integer (&cur, &integer))
+    fail ("cursor bool");
+
+  if (!json_cursor_field (&root, "girlfriend", &cur)
+      || json_cursor_type (&cur) != JSON_NULL)
+    fail ("cursor null");
+
+  if (!json_cursor_field (&root, "favorite language", &cur)
+      || !json_cursor_index (&cur, 2, &cur)
+      || !json_cursor_get_string (&cur, &str)
+      || strcmp (mstr_data (&str), "guile") != 0)
+    fail ("cursor string");
+
+  if (!json_cursor_field (&root, "other", &other)
+      || !json_cursor_field (&other, "array", &cur)
+      || !json_cursor_index (&cur, 3, &cur)
+      || !json_cursor_get_integer (&cur, &integer) || integer != -123
+      || json_cursor_get_uint (&cur, &uinteger))
+    fail ("cursor nested");
+
+  /* escapes are decoded only when the string is read */
+  if (!json_cursor_field (&other, "unicode", &cur)
+      || !json_cursor_field (&cur, "我喜欢", &cur)
+      || !json_cursor_get_string (&cur, &str)
+      || strcmp (mstr_data (&str), "我喜欢") != 0)
+    fail ("cursor unicode");
+
+  if (json_cursor_field (&root, "missing", &cur)
+      || json_cursor_field (&root, "ag", &cur)
+      || !json_cursor_field (&root, "favorite language", &cur)
+      || json_cursor_index (&cur, 4, &cur)
+      || json_cursor_index (&root, 0, &cur))
+    fail ("cursor missing");
+
+  if (!json_cursor_field (&other, "object", &cur)
+      || !(sub = json_cursor_decode (&cur))
+      || !same (sub, json_object_get (json_object_get (json, "other")->value,
+				      "object")->value))
+    fail ("cursor decode");
+  json_free (sub);
+
+  if (!json_cursor_init (&cur, " 18446744073709551615", 21)
+      || json_cursor_type (&cur) != JSON_UINT
+      || !json_cursor_get_uint (&cur, &uinteger) || uinteger != UINT64_MAX
+      || json_cursor_get_integer (&cur, &integer))
+    fail ("cursor uint");
+
+  if (!json_cursor_init (&cur, "trux", 4) || json_cursor_type (&cur) != -1
+      || json_cursor_init (&cur, "  ", 2))
+    fail ("cursor invalid");
+
+  mstr_free (&str);
+}
+
+/* events are logged as short tokens, the stop event returns false */
+typedef struct
+{
+  mstr_t log;
+  int left;
+} sax_log_t;
+
+static bool
+sax_note (sax_log_t *s, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+static bool
+sax_note (sax_log_t *s, const char *fmt, ...)
+{
+  char buf[64];
+  va_list ap;
+
+  va_start (ap, fmt);
+  int n = vsnprintf (buf, sizeof (buf), fmt, ap);
+  va_end (ap);
+
+  mstr_cat_byte (&s->log, buf, n);
+  return --s->left != 0;
+}
+
+static bool
+sax_start_object (void *ctx)
+{
+  return sax_note (ctx, "{");
+}
+
+static bool
+sax_end_object (void *ctx)
+{
+  return sax_note (ctx, "}");
+}
+
+static bool
+sax_start_array (void *ctx)
+{
+  return sax_note (ctx, "[");
+}
+
+static bool
+sax_end_array (void *ctx)
+{
+  return sax_note (ctx, "]");
+}
+
+static bool
+sax_key (void *ctx, const char *data, size_t len)
+{
+  return sax_note (ctx, "k%.*s ", (int) len, data);
+}
+
+static bool
+sax_string (void *ctx, const char *data, size_t len)
+{
+  return sax_note (ctx, "s%.*s ", (int) len, data);
+}
+
+static bool
+sax_number (void *ctx, double value)
+{
+  return sax_note (ctx, "d%g ", value);
+}
+
+static bool
+sax_integer (void *ctx, int64_t value)
+{
+  return sax_note (ctx, "i%lld ", (long long) value);
+}
+
+static bool
+sax_uinteger (void *ctx, uint64_t value)
+{
+  return sax_note (ctx, "u%llu ", (unsigned long long) value);
+}
+
+static bool
+sax_boolean (void *ctx, bool value)
+{
+  return sax_note (ctx, value ? "t " : "f ");
+}
+
+static bool
+sax_null (void *ctx)
+{
+  return sax_note (ctx, "n ");
+}
+
+/* parses src with every callback and checks the log against want */
+static bool
+sax_run (const char *src, int left, const char *want)
+{
+  static const json_sax_handler_t handler = {
+    .start_object = sax_start_object,
+    .end_object = sax_end_object,
+    .start_array = sax_start_array,
+    .end_array = sax_end_array,
+    .key = sax_key,
+    .string = sax_string,
+    .number = sax_number,
+    .integer = sax_integer,
+    .uinteger = sax_uinteger,
+    .boolean = sax_boolean,
+    .null = sax_null,
+  };
+
+  sax_log_t s = { .log = MSTR_INIT, .left = left };
+  bool ret = json_sax_parse (src, strlen (src), &handler, &s);
+
+  if (strcmp (mstr_data (&s.log), want) != 0)
+    fail ("sax events");
+
+  mstr_free (&s.log);
+  return ret;
+}
+
+static void
+test_sax (size_t len)
+{
+  static const json_sax_handler_t none = {};
+  static const json_sax_handler_t numbers = { .number = sax_number };
+
+  const char *text = "{\"a\\\"b\":[1,-2,18446744073709551615,1.5,\"x\\ny\","
+		     "true,false,null],\"c\":{}}";
+
+  if (!sax_run (text, -1, "{ka\"b [i1 i-2 u18446744073709551615 d1.5 sx\ny "
+			  "t f n ]kc {}}"))
+    fail ("sax");
+
+  /* a callback returning false stops the parse at once */
+  if (sax_run (text, 4, "{ka\"b [i1 "))
+    fail ("sax stop");
+
+  /* malformed input fails after the events before the error */
+  if (sax_run ("[1,]", -1, "[i1 ") || sax_run ("[\"a\" 1]", -1, "[sa "))
+    fail ("sax error");
+
+  /* integers reach the number callback when integer is unset */
+  sax_log_t s = { .log = MSTR_INIT, .left = -1 };
+  if (!json_sax_parse ("[3,4.5]", 7, &numbers, &s)
+      || strcmp (mstr_data (&s.log), "d3 d4.5 ") != 0)
+    fail ("sax number");
+  mstr_free (&s.log);
+
+  if (!json_sax_parse (buff, len, &none, NULL))
+    fail ("sax no callbacks");
+
+  /* nesting is bounded only by max_depth, not by the C stack */
+  if (json_sax_parse_ex ("[[[1]]]", 7, &none, NULL, 2)
+      || !json_sax_parse_ex ("[[[1]]]", 7, &none, NULL, 3))
+    fail ("sax depth");
+
+  size_t depth = 100000;
+  char *deep = malloc (depth * 2);
+  if (!deep)
+    fail ("sax deep");
+
+  memset (deep, '[', depth);
+  memset (deep + depth, ']', depth);
+  if (!json_sax_parse (deep, depth * 2, &none, NULL))
+    fail ("sax deep");
+  free (deep);
+}
+
+/* splits land inside strings, escapes, surrogate pairs, numbers and
+   literals; the malformed ones must fail the same way */
+static const char *const push_docs[] = {
+  "[\"a\\\\b\\\"c\", \"\\u00e9\\ud83d\\ude00\", -12.5e-3, 0, -0]",
+  "{\"key\" : {\"nested\" : [true, false, null, 1e10, 12345678901234567890]}}",
+  "  \"plain string with spaces\"  ",
+  "123456",
+  "[1, 2,, 3]",
+  "{\"a\" 1}",
+  "[\"unterminated",
+  "tru",
+};
+
+/* feeds src in chunks of step bytes, the first one cut at split */
+static json_t *
+push (const char *src, size_t len, size_t split, size_t step)
+{
+  json_parser_t *p = json_parser_new ();
+  json_t *ret = NULL;
+
+  if (!p)
+    return NULL;
+
+  for (size_t at = 0, n = split; at < len; at += n, n = step)
+    {
+      if (n > len - at)
+	n = len - at;
+
+      if (!json_parser_feed (p, src + at, n))
+	goto out;
+    }
+
+  ret = json_parser_finish (p);
+
+out:
+  json_parser_free (p);
+  return ret;
+}
+
+static void
+check_push (const char *src, size_t len)
+{
+  json_t *json = json_decode_n (src, len, NULL);
+
+  for (size_t split = 0; split <= len; split++)
+    {
+      json_t *whole = push (src, len, split, len);
+      json_t *bytes = push (src, len, split, 1);
+
+      if (!same (json, whole) || !same (json, bytes))
+	{
+	  printf ("push differs at %zu: %.*s\n", split, (int) len, src);
+	  fail ("push");
+	}
+
+      json_free (whole);
+      json_free (bytes);
+    }
+
+  json_free (json);
+}
+
+static void
+test_push (size_t len)
+{
+  check_push (buff, len);
+
+  for (size_t i = 0; i < sizeof (push_docs) / sizeof (*push_docs); i++)
+    check_push (push_docs[i], strlen (push_docs[i]));
+}
+
+#define LINES 60000
+
+/* every 997th line is malformed and every 1009th is blank */
+typedef struct
+{
+  const char *text;
+  bool seen[LINES];
+  size_t calls;
+  size_t last;
+  size_t stop;
+  int inside;
+  bool ordered;
+} lines_log_t;
+
+static bool
+lines_record (void *ctx, const json_t *json, size_t offset)
+{
+  lines_log_t *log = ctx;
+  json_pair_t *pair;
+
+  /* calls never overlap */
+  if (__atomic_fetch_add (&log->inside, 1, __ATOMIC_SEQ_CST))
+    fail ("lines overlap");
+
+  if (log->ordered && log->calls && offset <= log->last)
+    fail ("lines order");
+
+  if (!json)
+    {
+      if (memcmp (log->text + offset, "oops", 4) != 0)
+	fail ("lines malformed");
+    }
+  else if (!(pair = json_object_get (json, "n"))
+	   || pair->value->data.integer < 0
+	   || pair->value->data.integer >= LINES
+	   || log->seen[pair->value->data.integer])
+    fail ("lines value");
+  else
+    log->seen[pair->value->data.integer] = true;
+
+  log->last = offset;
+  __atomic_fetch_sub (&log->inside, 1, __ATOMIC_SEQ_CST);
+  return ++log->calls != log->stop;
+}
+
+static void
+test_lines (void)
+{
+  static const int modes[] = {
+    0, JSON_DECODE_ORDERED, JSON_DECODE_ORDERED | JSON_DECODE_FAST,
+    JSON_DECODE_FAST | JSON_DECODE_INTERN,
+  };
+
+  mstr_t text = MSTR_INIT;
+  size_t values = 0, lines = 0;
+  char line[64];
+
+  for (int i = 0; i < LINES; i++)
+    {
+      int n;
+
+      if (i % 997 == 0)
+	n = sprintf (line, "oops\n");
+      else if (i % 1009 == 0)
+	n = sprintf (line, " \t\n");
+      else
+	n = sprintf (line, "{\"n\":%d, \"pad\":[1,2,3]}\n", i);
+
+      values += i % 997 && i % 1009;
+      lines += i % 1009 || i % 997 == 0;
+      mstr_cat_byte (&text, line, n);
+    }
+
+  /* several chunks, decoded on several threads */
+  for (size_t m = 0; m < sizeof (modes) / sizeof (*modes); m++)
+    {
+      lines_log_t *log = calloc (1, sizeof (lines_log_t));
+      size_t seen = 0;
+
+      if (!log)
+	fail ("lines");
+
+      log->text = mstr_data (&text);
+      log->ordered = modes[m] & JSON_DECODE_ORDERED;
+      log->stop = (size_t) -1;
+
+      if (!json_decode_lines (mstr_data (&text), mstr_len (&text), 4,
+			      modes[m], lines_record, log)
+	  || log->calls != lines)
+	fail ("lines");
+
+      for (int i = 0; i < LINES; i++)
+	seen += log->seen[i];
+      if (seen != values)
+	fail ("lines values");
+
+      /* a callback returning false is the last one called */
+      memset (log, 0, sizeof (lines_log_t));
+      log->text = mstr_data (&text);
+      log->stop = 10;
+
+      if (json_decode_lines (mstr_data (&text), mstr_len (&text), 4,
+			     modes[m], lines_record, log)
+	  || log->calls != 10)
+	fail ("lines stop");
+
+      free (log);
+    }
+
+  mstr_free (&text);
+}
+
+#define RECORDS 20000
+
+/* separators inside strings must not split the top-level array */
+static const char *const parallel_docs[] = {
+  "[]", " [ ] ", "[1]", "{\"a\":1}", "5", "[1,]", "[,1]", "[1 2]", "[", "",
+  "[\"a,]\\\"[b\",[1,{\"b\":[]}],true] trailing",
+};
+
+/* a top-level array of records large enough to be split */
+static void
+parallel_records (mstr_t *src)
+{
+  char item[128];
+
+  mstr_cat_cstr (src, " [ ");
+  for (int i = 0; i < RECORDS; i++)
+    {
+      snprintf (item, sizeof (item),
+		"%s{\"id\":%d,\"s\":\"a,]\\\"[b\",\"v\":[%d,{\"x\":null}]}",
+		i ? " ,\n " : "", i, i * 7);
+      mstr_cat_cstr (src, item);
+    }
+  mstr_cat_cstr (src, " ]");
+}
+
+static void
+check_parallel_decode (const char *src, size_t len)
+{
+  json_t *json = json_decode_n (src, len, NULL);
+
+  for (int nthreads = 1; nthreads <= 8; nthreads *= 2)
+    {
+      json_t *parallel = json_decode_parallel (src, len, nthreads);
+
+      if (!same (json, parallel))
+	{
+	  printf ("parallel decode differs with %d threads: %.60s\n",
+		  nthreads, src);
+	  fail ("parallel decode");
+	}
+
+      json_free (parallel);
+    }
+
+  json_free (json);
+}
+
+static void
+test_parallel_decode (void)
+{
+  mstr_t src = MSTR_INIT;
+
+  parallel_records (&src);
+  check_parallel_decode (mstr_data (&src), mstr_len (&src));
+
+  /* a malformed record anywhere must fail the whole decode */
+  char *data = mstr_data (&src);
+  data[mstr_len (&src) / 2] = '}';
+  check_parallel_decode (data, mstr_len (&src));
+
+  for (size_t i = 0; i < sizeof (parallel_docs) / sizeof (*parallel_docs); i++)
+    check_parallel_decode (parallel_docs[i], strlen (parallel_docs[i]));
+
+  mstr_free (&src);
+}
+
+/* output is appended to what mstr already holds, byte for byte */
+static void
+check_parallel_encode (const json_t *json)
+{
+  mstr_t expect = MSTR_INIT;
+
+  if (!json_encode (&expect, json))
+    fail ("parallel encode");
+
+  for (int nthreads = 1; nthreads <= 8; nthreads++)
+    {
+      mstr_t out = MSTR_INIT;
+
+      if (!mstr_cat_cstr (&out, "pre")
+	  || !json_encode_parallel (&out, json, nthreads)
+	  || mstr_len (&out) != mstr_len (&expect) + 3
+	  || strcmp (mstr_data (&out) + 3, mstr_data (&expect)) != 0)
+	{
+	  printf ("parallel encode differs with %d threads\n", nthreads);
+	  fail ("parallel encode");
+	}
+
+      mstr_free (&out);
+    }
+
+  mstr_free (&expect);
+}
+
+static void
+test_parallel_encode (void)
+{
+  mstr_t src = MSTR_INIT, wide = MSTR_INIT;
+  char item[128];
+
+  parallel_records (&src);
+
+  /* a wide object next to the array splits at both kinds of container */
+  mstr_cat_cstr (&wide, "{");
+  for (int i = 0; i < RECORDS / 10; i++)
+    {
+      snprintf (item, sizeof (item), "%s\"key %d\":[\"\\u00e9\",1.5]",
+		i ? "," : "", i);
+      mstr_cat_cstr (&wide, item);
+    }
+  mstr_cat_cstr (&wide, "}");
+
+  json_t *json = json_decode_n (mstr_data (&src), mstr_len (&src), NULL);
+  json_t *object = json_decode_n (mstr_data (&wide), mstr_len (&wide), NULL);
+
+  if (!json || !object)
+    fail ("parallel encode");
+
+  check_parallel_encode (json);
+  if (!json_array_add (json, object))
+    fail ("parallel encode");
+  check_parallel_encode (json);
+
+  mstr_free (&wide);
+  mstr_free (&src);
+  json_free (json);
+}
+
+#define DEEP 200000
+
+/* DEEP arrays, or objects keyed "a" when object is set, around a 1;
+   the text is terminated */
+static char *
+deep_text (bool object, size_t *len)
+{
+  size_t open = object ? 5 : 1;
+  char *text = malloc (DEEP * (open + 1) + 2);
+
+  if (!text)
+    fail ("deep text");
+
+  for (size_t i = 0; i < DEEP; i++)
+    memcpy (text + i * open, object ? "{\"a\":" : "[", open);
+
+  text[DEEP * open] = '1';
+  memset (text + DEEP * open + 1, object ? '}' : ']', DEEP);
+  text[DEEP * (open + 1) + 1] = '\0';
+
+  *len = DEEP * (open + 1) + 1;
+  return text;
+}
+
+static void
+test_depth (void)
+{
+  json_doc_t *doc;
+  json_t *json;
+
+  /* both kinds of container count against the limit */
+  if ((json = json_decode_ex ("[[[1]]]", 7, NULL, 0, 2))
+      || !(json = json_decode_ex ("[[[1]]]", 7, NULL, 0, 3)))
+    fail ("depth limit");
+  json_free (json);
+
+  if ((json = json_decode_ex ("{\"a\":[{}]}", 10, NULL, 0, 2))
+      || !(json = json_decode_ex ("{\"a\":[{}]}", 10, NULL, 0, 3)))
+    fail ("depth limit object");
+  json_free (json);
+
+  if ((doc = json_decode_arena_ex ("[[1]]", 5, NULL, 0, 1))
+      || !(doc = json_decode_arena_ex ("[[1]]", 5, NULL, 0, 2)))
+    fail ("depth limit arena");
+  json_doc_free (doc);
+
+  /* without a limit nesting is bounded by memory, not the C stack */
+  for (int object = 0; object < 2; object++)
+    {
+      size_t len;
+      char *text = deep_text (object, &len);
+
+      if (!(json = json_decode_n (text, len, NULL)))
+	fail ("depth deep");
+      json_free (json);
+
+      if (!(doc = json_decode_arena_n (text, len, NULL))
+	  || (json = json_decode_ex (text, len, NULL, 0, DEEP - 1)))
+	fail ("depth deep");
+
+      json_doc_free (doc);
+      free (text);
+    }
+}
+
+static void
+test_deep_encode (void)
+{
+  for (int object = 0; object < 2; object++)
+    {
+      size_t len;
+      char *text = deep_text (object, &len);
+      json_t *json;
+
+      /* encoding and freeing walk any depth without recursion */
+      if (!(json = json_decode_n (text, len, NULL))
+	  || json_encoded_size (json) != len || !encodes_to (json, text))
+	fail ("deep encode");
+
+      json_free (json);
+      free (text);
+    }
+}
+
+/* the value pointer names encodes to text, NULL when it names none */
+static bool
+extracts_to (const char *src, size_t len, const char *pointer,
+	     const char *text)
+{
+  json_t *json;
+  bool found = json_extract (src, len, pointer, &json);
+  bool ret = found == !!text && encodes_to (json, text);
+
+  json_free (json);
+  return ret;
+}
+
+static void
+test_extract (const mstr_t *whole, size_t len)
+{
+  const char *esc = "{\"a/b\":1,\"m~n\":2,\"~1\":3,\"\":4}";
+
+  if (!extracts_to (buff, len, "", mstr_data (whole))
+      || !extracts_to (buff, len, "/age", "20")
+      || !extracts_to (buff, len, "/favorite language/1", "\"c++\"")
+      || !extracts_to (buff, len, "/other/array/4", "\"\\\"string\\\"\"")
+      || !extracts_to (buff, len, "/other/object", "{\"array\":[],"
+			  "\"object\":{},\"string\":\"a\"}")
+      || !extracts_to (buff, len, "/other/unicode/你好", "\"你好\""))
+    fail ("extract");
+
+  /* ~1 is '/' and ~0 is '~', decoded once */
+  if (!extracts_to (esc, strlen (esc), "/a~1b", "1")
+      || !extracts_to (esc, strlen (esc), "/m~0n", "2")
+      || !extracts_to (esc, strlen (esc), "/~01", "3")
+      || !extracts_to (esc, strlen (esc), "/", "4"))
+    fail ("extract escape");
+
+  if (!extracts_to (buff, len, "age", NULL)
+      || !extracts_to (buff, len, "/missing", NULL)
+      || !extracts_to (buff, len, "/age/0", NULL)
+      || !extracts_to (buff, len, "/favorite language/4", NULL)
+      || !extracts_to (buff, len, "/favorite language/01", NULL)
+      || !extracts_to (buff, len, "/favorite language/-", NULL)
+      || !extracts_to (esc, strlen (esc), "/m~2n", NULL))
+    fail ("extract miss");
+}
+
+static void
+test_query (const json_t *json, size_t len)
+{
+  static const char *const exprs[] = {
+    "/age",
+    "$['favorite language'][2]",
+    "$.other.array[3]",
+    "/other/unicode/你好",
+    "$.missing",
+    "$.other.object",
+    "$.age",
+    "$.other['array'][9]",
+  };
+
+  static const char *const want[] = {
+    "20", "\"guile\"", "-123", "\"你好\"", NULL,
+    "{\"array\":[],\"object\":{},\"string\":\"a\"}", "20", NULL,
+  };
+
+  enum { N = sizeof (exprs) / sizeof (*exprs) };
+
+  const json_t *found[N];
+  json_t *results[N];
+  json_query_t *query;
+
+  if (!(query = json_query_compile (exprs, N)))
+    fail ("query compile");
+
+  /* one pass over the text and one walk of the tree agree */
+  if (!json_query_run (query, buff, len, results))
+    fail ("query run");
+
+  json_query_eval (query, json, found);
+
+  for (size_t i = 0; i < N; i++)
+    {
+      if (!encodes_to (results[i], want[i]) || !encodes_to (found[i], want[i]))
+	fail ("query result");
+      json_free (results[i]);
+    }
+
+  /* malformed text fails the run and leaves no results */
+  if (json_query_run (query, "{\"age\":1,", 9, results) || results[0])
+    fail ("query malformed");
+
+  json_query_free (query);
+
+  /* keys containing dots, and repeated keys follow their first match */
+  const char *dots[] = { "$['a.b']", "$.a" };
+  const char *text = "{\"a.b\":1,\"a\":{\"x\":2},\"a\":3}";
+
+  if (!(query = json_query_compile (dots, 2))
+      || !json_query_run (query, text, strlen (text), results)
+      || !encodes_to (results[0], "1")
+      || !encodes_to (results[1], "{\"x\":2}"))
+    fail ("query keys");
+
+  json_free (results[0]);
+  json_free (results[1]);
+  json_query_free (query);
+
+  const char *bad[] = { "$.a[" };
+  if ((query = json_query_compile (bad, 1)))
+    fail ("query compile error");
+}
+
 int
 main (void)
 {
@@ -14,7 +1482,7 @@ main (void)
   FILE *file = fopen ("test.json", "r");
   size_t len = fread (buff, 1, 4096, file);
 
-  if (!(json = json_decode (buff)))
+  if (!(json = json_decode_n (buff, len, NULL)))
     {
       printf ("decode failed\n");
       exit (1);
@@ -28,6 +1496,32 @@ main (void)
 
   printf ("encode result: %s\n", mstr_data (&result));
 
+  test_arena (json, len);
+  test_bounded ();
+  test_strings ();
+  test_whitespace ();
+  test_parse_real ();
+  test_integers ();
+  test_format_real ();
+  test_escape ();
+  test_encode_size (json, &result);
+  test_stream (json, &result);
+  test_object_churn ();
+  test_small_object ();
+  test_intern ();
+  test_key_handle ();
+  test_fast (len);
+  test_cursor (json, len);
+  test_sax (len);
+  test_push (len);
+  test_lines ();
+  test_parallel_decode ();
+  test_parallel_encode ();
+  test_depth ();
+  test_deep_encode ();
+  test_extract (&result, len);
+  test_query (json, len);
+
   mstr_free (&result);
   json_free (json);
   fclose (file);